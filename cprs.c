@@ -40,8 +40,25 @@ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
 OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
 THE SOFTWARE. */
 
+#include <pthread.h>
 #include "cprs.h"
 
+#define CPRS_BEST_MT	0x4000	//!< Inputs this big race on threads.
+
+//! One of the methods racing in cprs_compress_best().
+typedef struct CPRSRACE
+{
+	const BYTE *src;
+	uint srcS;
+	int method, level;
+	uint *best;		// Smallest size so far; shared by all
+	BYTE *out;
+	int size;
+} CPRSRACE;
+
+static int cprs_compress_limit(BYTE *dst, uint dstS, const BYTE *src, 
+	uint srcS, int method, int level, const uint *limit);
+
 //! Create the compression header word (little endian)
 u32	cprs_create_header(uint size, u8 tag)
 {
@@ -54,3 +71,338 @@ u32	cprs_create_header(uint size, u8 tag)
 	return *(u32*)data;
 }
 
+//! Largest possible output when compressing \a size bytes with \a tag.
+/*!	Worst cases, header included:
+	- LZ77: all literals, so a flag byte per 8 bytes.
+	- RLE: all literals, so a header byte per 0x80 bytes, plus one 
+	  for a short last stretch. Short stretches elsewhere are always
+	  followed by a run, which more than pays for the header.
+	- Huffman: the tree, plus never more bits per symbol than the
+	  symbol has, as a fixed length code would do that.
+	- Diff: the same size as the input.
+	\return The bound, or 0 for unknown tags.
+*/
+uint cprs_compress_bound(uint size, u8 tag)
+{
+	switch(tag)
+	{
+	case CPRS_LZ77_TAG:
+		return ALIGN4(4 + size + (size+7)/8);
+	case CPRS_RLE_TAG:
+		return ALIGN4(4 + size + size/0x80 + 1);
+	case CPRS_HUFF1_TAG:
+		return 4 + 2*2 + ALIGN4(size);
+	case CPRS_HUFF2_TAG:
+		return 4 + 2*4 + ALIGN4(size);
+	case CPRS_HUFF4_TAG:
+		return 4 + 2*16 + ALIGN4(size);
+	case CPRS_HUFF_TAG:
+	case CPRS_HUFF8_TAG:
+		return 4 + 2*256 + ALIGN4(size);
+	case CPRS_DIFF8_TAG:
+	case CPRS_DIFF16_TAG:
+		return 4 + ALIGN4(size);
+	}
+	return 0;
+}
+
+//! Get the decompressed size from the header of \a src.
+/*!	\return The size, or CPRS_ERR_DATA if there's no header.
+*/
+int cprs_decompress_size(const BYTE *src, uint srcS)
+{
+	if(src==NULL || srcS < 4)
+		return CPRS_ERR_DATA;
+	return read32le(src)>>8;
+}
+
+//! Compress with any method, in a caller-supplied buffer.
+/*!	\param method	A compression tag, or CPRS_LZ77_TAG|CPRS_WRAM.
+	\return Size of the compressed data, or a negative ECprsError.
+*/
+int cprs_compress_buf(BYTE *dst, uint dstS, const BYTE *src, uint srcS, 
+	int method, int level)
+{
+	return cprs_compress_limit(dst, dstS, src, srcS, method, level, NULL);
+}
+
+//! As cprs_compress_buf(), but giving up once the output is past 
+//! \a *limit, where the method can tell; the diff filters can't.
+static int cprs_compress_limit(BYTE *dst, uint dstS, const BYTE *src, 
+	uint srcS, int method, int level, const uint *limit)
+{
+	switch(method)
+	{
+	case CPRS_LZ77_TAG:
+		return lz77gba_compress_limit(NULL, dst, dstS, src, srcS, level, 1, limit);
+	case CPRS_LZ77_TAG|CPRS_WRAM:
+		return lz77gba_compress_limit(NULL, dst, dstS, src, srcS, level, 0, limit);
+	case CPRS_HUFF1_TAG:
+		return huffman_encode_limit(NULL, dst, dstS, src, srcS, 1, limit);
+	case CPRS_HUFF2_TAG:
+		return huffman_encode_limit(NULL, dst, dstS, src, srcS, 2, limit);
+	case CPRS_HUFF4_TAG:
+		return huffman_encode_limit(NULL, dst, dstS, src, srcS, 4, limit);
+	case CPRS_HUFF8_TAG:
+		return huffman_encode_limit(NULL, dst, dstS, src, srcS, 8, limit);
+	case CPRS_HUFF_TAG:
+		return huffman_encode_limit(NULL, dst, dstS, src, srcS, 0, limit);
+	case CPRS_RLE_TAG:
+		return rle8gba_compress_limit(dst, dstS, src, srcS, level, limit);
+	case CPRS_DIFF8_TAG:
+		return diffgba_compress_buf(dst, dstS, src, srcS, 8);
+	case CPRS_DIFF16_TAG:
+		return diffgba_compress_buf(dst, dstS, src, srcS, 16);
+	}
+	return CPRS_ERR_ARG;
+}
+
+//! Decompress whatever \a src holds, in a caller-supplied buffer.
+/*!	\return Size of the output, or a negative ECprsError.
+*/
+int cprs_decompress_buf(BYTE *dst, uint dstS, const BYTE *src, uint srcS)
+{
+	if(src==NULL || srcS < 4)
+		return CPRS_ERR_DATA;
+
+	switch(src[0])
+	{
+	case CPRS_LZ77_TAG:
+		return lz77gba_decompress_buf(dst, dstS, src, srcS);
+	case CPRS_HUFF1_TAG:
+	case CPRS_HUFF2_TAG:
+	case CPRS_HUFF4_TAG:
+	case CPRS_HUFF8_TAG:
+		return huffman_decode_buf(dst, dstS, src, srcS);
+	case CPRS_RLE_TAG:
+		return rle8gba_decompress_buf(dst, dstS, src, srcS);
+	case CPRS_DIFF8_TAG:
+	case CPRS_DIFF16_TAG:
+		return diffgba_decompress_buf(dst, dstS, src, srcS);
+	}
+	return CPRS_ERR_DATA;
+}
+
+//! Run one of the methods in cprs_compress_best(), and if it did 
+//! better than the others so far, make it the one to beat.
+static void *cprs_race(void *arg)
+{
+	CPRSRACE *race= (CPRSRACE*)arg;
+	uint outS= cprs_compress_bound(race->srcS, race->method & 0xFF), best;
+
+	if(outS == 0)
+	{
+		race->size= CPRS_ERR_ARG;
+		return NULL;
+	}
+	if((race->out= (BYTE*)malloc(outS)) == NULL)
+	{
+		race->size= CPRS_ERR_MEM;
+		return NULL;
+	}
+
+	race->size= cprs_compress_limit(race->out, outS, race->src, race->srcS,
+		race->method, race->level, race->best);
+
+	best= __atomic_load_n(race->best, __ATOMIC_RELAXED);
+	while(race->size >= 0 && (uint)race->size < best && 
+		!__atomic_compare_exchange_n(race->best, &best, race->size, 1, 
+			__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+	return NULL;
+}
+
+//! Compress with each of \a methods at once, and keep the smallest.
+/*!	Every method gets a thread, and gives up as soon as its output 
+	is bigger than one that's already done. The time taken is about
+	that of the slowest method that can still win, not the sum. 
+	Small inputs go through the methods one after the other.
+	\param methods	As for cprs_compress_buf().
+	\param sizes	If not NULL, gets the size each method came to, or 
+	  a negative ECprsError; CPRS_ERR_SPACE for those that gave up.
+	\return Size of the smallest output, or 0 on failure. Ties go to
+	  the method that comes first.
+*/
+uint cprs_compress_best(RECORD *dst, const RECORD *src, 
+	const int *methods, int count, int level, int *sizes)
+{
+	if(src==NULL || dst==NULL || src->data==NULL || methods==NULL || count<1)
+		return 0;
+
+	CPRSRACE *races= (CPRSRACE*)calloc(count, sizeof(CPRSRACE));
+	pthread_t *tids= (pthread_t*)malloc(count*sizeof(pthread_t));
+	uint best= 0xFFFFFFFF;
+	int ii, win= -1, started= 0;
+
+	if(races == NULL || tids == NULL)
+	{
+		free(races);
+		free(tids);
+		return 0;
+	}
+
+	for(ii=0; ii<count; ii++)
+	{
+		races[ii].src= src->data;
+		races[ii].srcS= rec_size(src);
+		races[ii].method= methods[ii];
+		races[ii].level= level;
+		races[ii].best= &best;
+	}
+
+	// Any that don't get a thread run here, after the first.
+	for(started=1; started<count && rec_size(src) >= CPRS_BEST_MT; started++)
+		if(pthread_create(&tids[started], NULL, cprs_race, &races[started]))
+			break;
+	cprs_race(&races[0]);
+	for(ii=1; ii<count; ii++)
+	{
+		if(ii < started)
+			pthread_join(tids[ii], NULL);
+		else
+			cprs_race(&races[ii]);
+	}
+
+	for(ii=0; ii<count; ii++)
+	{
+		if(sizes != NULL)
+			sizes[ii]= races[ii].size;
+		if(races[ii].size >= 0 && (win < 0 || races[ii].size < races[win].size))
+			win= ii;
+	}
+	for(ii=0; ii<count; ii++)
+		if(ii != win)
+			free(races[ii].out);
+
+	uint size= 0;
+	if(win >= 0)
+	{
+		size= races[win].size;
+		rec_attach_fit(dst, races[win].out, size);
+	}
+
+	free(races);
+	free(tids);
+	return size;
+}
+
+//! Make sure \a *buf holds at least \a size bytes.
+static int cprs_reserve(BYTE **buf, uint *cap, uint size)
+{
+	BYTE *tmp;
+
+	if(*cap >= size)
+		return 1;
+	if((tmp= (BYTE*)realloc(*buf, size ? size : 1)) == NULL)
+		return 0;
+	*buf= tmp;
+	*cap= size;
+	return 1;
+}
+
+//! Compress with \a methods[0], then the result with \a methods[1]...
+/*!	Stages go back and forth between two buffers, so memory use 
+	doesn't grow with the length of the chain.
+	\param methods	As for cprs_compress_buf().
+	\return Size of the final output, or 0 on failure.
+*/
+uint cprs_compress_chain(RECORD *dst, const RECORD *src, 
+	const int *methods, int count, int level)
+{
+	if(src==NULL || dst==NULL || src->data==NULL || methods==NULL || count<1)
+		return 0;
+
+	BYTE *buf[2]= { NULL, NULL };
+	uint cap[2]= { 0, 0 };
+	const BYTE *cur= src->data;
+	int ii, size= rec_size(src);
+
+	for(ii=0; ii<count; ii++)
+	{
+		BYTE **out= &buf[ii&1];
+		uint *outCap= &cap[ii&1];
+
+		if(!cprs_reserve(out, outCap, 
+			cprs_compress_bound(size, methods[ii] & 0xFF)))
+			break;
+		size= cprs_compress_buf(*out, *outCap, cur, size, methods[ii], level);
+		if(size < 0)
+			break;
+		cur= *out;
+	}
+	free(buf[ii&1]);
+	if(ii < count)
+	{
+		free(buf[(ii&1)^1]);
+		return 0;
+	}
+	rec_attach_fit(dst, buf[(ii&1)^1], size);
+
+	return size;
+}
+
+//! Whether \a src looks like it was compressed by us.
+/*!	True for a known tag, output that's padded to 4 like ours, and 
+	no more than the most that size would compress to.
+*/
+static int cprs_is_nested(const BYTE *src, uint srcS)
+{
+	uint size, bound;
+
+	if(srcS < 4 || (srcS&3))
+		return 0;
+	size= read32le(src)>>8;
+	bound= cprs_compress_bound(size, src[0]);
+	if(src[0] == CPRS_HUFF_TAG || bound == 0 || srcS > bound)
+		return 0;
+	if(src[0] == CPRS_DIFF8_TAG || src[0] == CPRS_DIFF16_TAG)
+		return srcS == bound;
+	return 1;
+}
+
+//! Decompress \a src, and keep going while the result is compressed.
+/*!	Stages go back and forth between two buffers. The unwrapping 
+	stops at the first stage that doesn't look compressed or fails 
+	to decode; plain data that happens to be a valid GBA stream 
+	will be unwrapped too. A stream can decode to itself, so no 
+	more than CPRS_CHAIN_MAX stages are unwrapped; past that, the 
+	output is still compressed.
+	\return Size of the final output, or 0 if even the first stage
+	  fails.
+*/
+uint cprs_decompress_chain(RECORD *dst, const RECORD *src)
+{
+	if(src==NULL || dst==NULL || src->data==NULL)
+		return 0;
+
+	BYTE *buf[2]= { NULL, NULL };
+	uint cap[2]= { 0, 0 };
+	const BYTE *cur= src->data;
+	int ii= 0, size= rec_size(src), outS;
+
+	do
+	{
+		BYTE **out= &buf[ii&1];
+		uint *outCap= &cap[ii&1];
+
+		outS= cprs_decompress_size(cur, size);
+		if(outS < 0 || !cprs_reserve(out, outCap, outS))
+			break;
+		outS= cprs_decompress_buf(*out, *outCap, cur, size);
+		if(outS < 0)
+			break;
+		cur= *out;
+		size= outS;
+		ii++;
+	} while(ii < CPRS_CHAIN_MAX && cprs_is_nested(cur, size));
+
+	free(buf[ii&1]);
+	if(ii == 0)
+	{
+		free(buf[1]);
+		return 0;
+	}
+	rec_attach_fit(dst, buf[(ii&1)^1], size);
+
+	return size;
+}
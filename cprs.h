@@ -83,6 +83,13 @@ INLINE void rec_attach(RECORD *dst, const void *data, int width, int height)
 	dst->data= (BYTE*)data;
 }
 
+//! Attach \a size bytes of malloc'ed \a data, giving back any slack.
+INLINE void rec_attach_fit(RECORD *dst, void *data, int size)
+{
+	void *fit= realloc(data, size ? size : 1);
+	rec_attach(dst, fit ? fit : data, 1, size);
+}
+
 //! Read a little-endian 32bit number.
 INLINE DWORD read32le(const BYTE *src)
 {	return src[0] | src[1]<<8 | src[2]<<16 | src[3]<<24;			}
@@ -108,31 +115,166 @@ enum ECprsTag
 {
 	CPRS_FAKE_TAG	= 0x00,		//<! No compression.
 	CPRS_LZ77_TAG	= 0x10,		//<! GBA LZ77 compression.
-	CPRS_HUFF_TAG	= 0x20, 
+	CPRS_HUFF_TAG	= 0x20,		//<! GBA Huffman, 4 or 8bit, whichever is smaller.
+	CPRS_HUFF1_TAG	= 0x21,		//<! GBA Huffman, 1bit.
+	CPRS_HUFF2_TAG	= 0x22,		//<! GBA Huffman, 2bit.
 	CPRS_HUFF4_TAG	= 0x24,		//<! GBA Huffman, 4bit.
 	CPRS_HUFF8_TAG	= 0x28,		//<! GBA Huffman, 8bit.
 	CPRS_RLE_TAG	= 0x30,		//<! GBA RLE compression.
-//	CPRS_DIFF8_TAG	= 0x81,		//<! GBA Diff-filter, 8bit.
-//	CPRS_DIFF16_TAG	= 0x82,		//<! GBA Diff-filter, 16bit.
+	CPRS_DIFF8_TAG	= 0x81,		//<! GBA Diff-filter, 8bit.
+	CPRS_DIFF16_TAG	= 0x82,		//<! GBA Diff-filter, 16bit.
 };
 
 #define ALIGN4(nn) ( ((nn)+3)&~3 )
 
+//! Added to CPRS_LZ77_TAG to name LZ77 with distance 1 matches, 
+//! which only LZ77UnCompWram can handle. Tagged as plain LZ77.
+#define CPRS_WRAM		0x100
+
+#define CPRS_SIZE_MAX	0x00FFFFFF	//!< Largest size a header can hold.
+#define CPRS_SIZE_UNKNOWN	0xFFFFFFFF	//!< Stream size not known up front.
+#define CPRS_CHAIN_MAX	16	//!< Most stages cprs_decompress_chain() unwraps.
+
+//! Error codes; the *_buf functions return these instead of a size.
+enum ECprsError
+{
+	CPRS_ERR_ARG	= -1,	//<! Bad arguments.
+	CPRS_ERR_SPACE	= -2,	//<! Destination buffer too small.
+	CPRS_ERR_DATA	= -3,	//<! Malformed compressed data.
+	CPRS_ERR_MEM	= -4,	//<! Out of memory.
+};
+
+//! Compression levels.
+enum ECprsLevel
+{
+	CPRS_LEVEL_DEFAULT	= 0,	//<! Original encoder.
+	CPRS_LEVEL_FASTEST	= 1,	//<! Shallowest search.
+	CPRS_LEVEL_MAX		= 9,	//<! Deepest search.
+	CPRS_LEVEL_OPTIMAL	= 10,	//<! Optimal parse; slow, smallest.
+};
+
 
 // --------------------------------------------------------------------
 // PROTOTYPES 
 // --------------------------------------------------------------------
 
 u32	cprs_create_header(uint size, u8 tag); 
+uint cprs_compress_bound(uint size, u8 tag);
+int  cprs_decompress_size(const BYTE *src, uint srcS);
+
+// Any method; \a method is a tag, or CPRS_LZ77_TAG|CPRS_WRAM.
+int  cprs_compress_buf(BYTE *dst, uint dstS, const BYTE *src, uint srcS, 
+	int method, int level);
+int  cprs_decompress_buf(BYTE *dst, uint dstS, const BYTE *src, uint srcS);
+
+// Several methods on top of each other.
+uint cprs_compress_chain(RECORD *dst, const RECORD *src, 
+	const int *methods, int count, int level);
+uint cprs_decompress_chain(RECORD *dst, const RECORD *src);
+
+// Several methods at once, keeping the smallest.
+uint cprs_compress_best(RECORD *dst, const RECORD *src, 
+	const int *methods, int count, int level, int *sizes);
+
+//! LZ77 compressor state; one per thread. See cprs_lz.c.
+typedef struct LZ77CTX LZ77CTX;
 
-uint lz77gba_compress(RECORD *dst, const RECORD *src);
+LZ77CTX *lz77gba_create(void);
+void lz77gba_reset(LZ77CTX *ctx);
+void lz77gba_destroy(LZ77CTX *ctx);
+
+uint lz77gba_compress(RECORD *dst, const RECORD *src, int level, int vram);
+uint lz77gba_compress_ctx(LZ77CTX *ctx, RECORD *dst, const RECORD *src, int level, int vram);
+uint lz77gba_compress_mt(RECORD *dst, const RECORD *src, int level, int vram, int threads);
 uint lz77gba_decompress(RECORD *dst, const RECORD *src);
 
+//! Huffman encoder state; one per thread. See huffman.c.
+typedef struct HUFCTX HUFCTX;
+
+HUFCTX *huffman_create(void);
+void huffman_destroy(HUFCTX *ctx);
+
 uint huffman_encode(RECORD *dst, const RECORD *src, int data_size);
+uint huffman_encode_ctx(HUFCTX *ctx, RECORD *dst, const RECORD *src, int data_size);
 
-uint rle8gba_compress(RECORD *dst, const RECORD *src);
+uint rle8gba_compress(RECORD *dst, const RECORD *src, int level);
 uint rle8gba_decompress(RECORD *dst, const RECORD *src);
 uint huffman_decode    (RECORD *dst, const RECORD *src);
-uint huffman_decode_vba(RECORD *dst, const RECORD *src);
+
+uint diffgba_compress(RECORD *dst, const RECORD *src, int data_size);
+uint diffgba_decompress(RECORD *dst, const RECORD *src);
+
+// Caller-supplied buffers. These return the size of the output or a
+// negative ECprsError. Size \a dst with cprs_compress_bound() or 
+// cprs_decompress_size().
+int lz77gba_compress_buf(LZ77CTX *ctx, BYTE *dst, uint dstS, 
+	const BYTE *src, uint srcS, int level, int vram);
+int lz77gba_compress_mt_buf(BYTE *dst, uint dstS, 
+	const BYTE *src, uint srcS, int level, int vram, int threads);
+int lz77gba_decompress_buf(BYTE *dst, uint dstS, const BYTE *src, uint srcS);
+
+int huffman_encode_buf(HUFCTX *ctx, BYTE *dst, uint dstS, 
+	const BYTE *src, uint srcS, int data_size);
+int huffman_decode_buf(BYTE *dst, uint dstS, const BYTE *src, uint srcS);
+
+int rle8gba_compress_buf(BYTE *dst, uint dstS, const BYTE *src, uint srcS, int level);
+int rle8gba_decompress_buf(BYTE *dst, uint dstS, const BYTE *src, uint srcS);
+
+int diffgba_compress_buf(BYTE *dst, uint dstS, const BYTE *src, uint srcS, int data_size);
+int diffgba_decompress_buf(BYTE *dst, uint dstS, const BYTE *src, uint srcS);
+
+// The same, but giving up with CPRS_ERR_SPACE once the output is past
+// *limit, which other threads may lower while they run; NULL for none.
+int lz77gba_compress_limit(LZ77CTX *ctx, BYTE *dst, uint dstS, 
+	const BYTE *src, uint srcS, int level, int vram, const uint *limit);
+int huffman_encode_limit(HUFCTX *ctx, BYTE *dst, uint dstS, 
+	const BYTE *src, uint srcS, int data_size, const uint *limit);
+int rle8gba_compress_limit(BYTE *dst, uint dstS, const BYTE *src, uint srcS, 
+	int level, const uint *limit);
+
+// Streaming compression. Feed the data in pieces of any size, 
+// reading the output as you go, then finish and read the rest. 
+// Memory use doesn't depend on the data size.
+typedef struct LZ77STREAM LZ77STREAM;
+typedef struct RLESTREAM RLESTREAM;
+
+LZ77STREAM *lz77gba_stream_init(uint size, int level, int vram);
+int  lz77gba_stream_feed(LZ77STREAM *st, const BYTE *src, uint srcS);
+int  lz77gba_stream_read(LZ77STREAM *st, BYTE *dst, uint dstS);
+int  lz77gba_stream_finish(LZ77STREAM *st);
+void lz77gba_stream_destroy(LZ77STREAM *st);
+
+RLESTREAM *rle8gba_stream_init(uint size);
+int  rle8gba_stream_feed(RLESTREAM *st, const BYTE *src, uint srcS);
+int  rle8gba_stream_read(RLESTREAM *st, BYTE *dst, uint dstS);
+int  rle8gba_stream_finish(RLESTREAM *st);
+void rle8gba_stream_destroy(RLESTREAM *st);
+
+// Streaming decompression. Hand over the compressed data in pieces 
+// of any size, header included; each call decodes as much as fits.
+// Once the input is over, huffman_dstream_end() lets a last Huffman
+// word that was cut short be decoded.
+typedef struct LZ77DSTREAM LZ77DSTREAM;
+typedef struct RLEDSTREAM RLEDSTREAM;
+typedef struct HUFDSTREAM HUFDSTREAM;
+
+LZ77DSTREAM *lz77gba_dstream_init(void);
+int  lz77gba_dstream_decode(LZ77DSTREAM *st, BYTE *dst, uint dstS, 
+	const BYTE *src, uint srcS, uint *used);
+int  lz77gba_dstream_left(const LZ77DSTREAM *st);
+void lz77gba_dstream_destroy(LZ77DSTREAM *st);
+
+RLEDSTREAM *rle8gba_dstream_init(void);
+int  rle8gba_dstream_decode(RLEDSTREAM *st, BYTE *dst, uint dstS, 
+	const BYTE *src, uint srcS, uint *used);
+int  rle8gba_dstream_left(const RLEDSTREAM *st);
+void rle8gba_dstream_destroy(RLEDSTREAM *st);
+
+HUFDSTREAM *huffman_dstream_init(void);
+int  huffman_dstream_decode(HUFDSTREAM *st, BYTE *dst, uint dstS, 
+	const BYTE *src, uint srcS, uint *used);
+void huffman_dstream_end(HUFDSTREAM *st);
+int  huffman_dstream_left(const HUFDSTREAM *st);
+void huffman_dstream_destroy(HUFDSTREAM *st);
 
 #endif
@@ -0,0 +1,278 @@
+/*
+   Copyright (c) Utkan Güngördü <utkan@freeconsole.org>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 3 or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+
+   GNU General Public License for more details
+
+
+   You should have received a copy of the GNU General Public
+   License along with this program; if not, write to the
+   Free Software Foundation, Inc.,
+   51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+//
+//! \file cprs_diff.c
+//!   GBA Diff8/Diff16 filters
+//
+// === NOTES === 
+// * Not compression as such: every byte (or halfword) after the 
+//   first is replaced by its difference with the one before. Smooth
+//   data like palettes, heightmaps and sound turns into small 
+//   numbers, which LZ77 or RLE then do much better on. The BIOS 
+//   undoes it with Diff8bitUnFilter* and Diff16bitUnFilter.
+// * Diff16 works on halfwords, so its input has to be of even size.
+
+#include <stdlib.h>
+#include <memory.h>
+#include <assert.h>
+
+#include "cprs.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+
+// --------------------------------------------------------------------
+// PROTOTYPES
+// --------------------------------------------------------------------
+
+
+static void Diff8Filter(BYTE *dst, const BYTE *src, uint srcS);
+static void Diff16Filter(BYTE *dst, const BYTE *src, uint srcS);
+static void Diff8Unfilter(BYTE *dst, const BYTE *src, uint srcS);
+static void Diff16Unfilter(BYTE *dst, const BYTE *src, uint srcS);
+
+
+// --------------------------------------------------------------------
+// FUNCTIONS
+// --------------------------------------------------------------------
+
+
+//! Diff-filter for the GBA BIOS.
+/*!	\param data_size	8 or 16, for Diff8 or Diff16.
+*/
+uint diffgba_compress(RECORD *dst, const RECORD *src, int data_size)
+{
+	if(src==NULL || dst==NULL || src->data == NULL)
+		return 0;
+
+	u8 tag= data_size == 16 ? CPRS_DIFF16_TAG : CPRS_DIFF8_TAG;
+	uint srcS= rec_size(src), dstS= cprs_compress_bound(srcS, tag);
+	BYTE *dstD= (BYTE*)malloc(dstS);
+	if(dstD == NULL)
+		return 0;
+
+	int size= diffgba_compress_buf(dstD, dstS, src->data, srcS, data_size);
+	if(size < 0)
+	{
+		free(dstD);
+		return 0;
+	}
+	rec_attach_fit(dst, dstD, size);
+
+	return size;
+}
+
+//! Diff-filter in a caller-supplied buffer.
+/*!	\return Size of the filtered data, or a negative ECprsError. 
+	  An odd \a srcS for Diff16 is a CPRS_ERR_ARG.
+*/
+int diffgba_compress_buf(BYTE *dst, uint dstS, const BYTE *src, uint srcS, 
+	int data_size)
+{
+	if(dst==NULL || (src==NULL && srcS>0) || srcS > CPRS_SIZE_MAX)
+		return CPRS_ERR_ARG;
+	if(data_size != 8 && data_size != 16)
+		return CPRS_ERR_ARG;
+	if(data_size == 16 && (srcS&1))
+		return CPRS_ERR_ARG;
+
+	u8 tag= data_size == 16 ? CPRS_DIFF16_TAG : CPRS_DIFF8_TAG;
+	uint size= cprs_compress_bound(srcS, tag);
+	if(dstS < size)
+		return CPRS_ERR_SPACE;
+
+	write32le(dst, cprs_create_header(srcS, tag));
+	if(data_size == 16)
+		Diff16Filter(dst+4, src, srcS);
+	else
+		Diff8Filter(dst+4, src, srcS);
+
+	// Zero the padding, or identical inputs give different outputs.
+	memset(dst+4+srcS, 0, size-4-srcS);
+
+	return size;
+}
+
+uint diffgba_decompress(RECORD *dst, const RECORD *src)
+{
+	assert(dst && src && src->data);
+	if(dst==NULL || src==NULL || src->data==NULL)
+		return 0;
+
+	int dstS= cprs_decompress_size(src->data, rec_size(src));
+	if(dstS < 0)
+		return 0;
+
+	BYTE *dstD= (BYTE*)malloc(dstS ? dstS : 1);
+	if(dstD == NULL)
+		return 0;
+
+	int size= diffgba_decompress_buf(dstD, dstS, src->data, rec_size(src));
+	if(size < 0)
+	{
+		free(dstD);
+		return 0;
+	}
+	rec_attach(dst, dstD, 1, size);
+
+	return size;
+}
+
+//! Undo a Diff8 or Diff16 filter in a caller-supplied buffer.
+/*!	\return Size of the output, or a negative ECprsError.
+*/
+int diffgba_decompress_buf(BYTE *dst, uint dstS, const BYTE *src, uint srcS)
+{
+	if(dst==NULL || src==NULL)
+		return CPRS_ERR_ARG;
+
+	int size= cprs_decompress_size(src, srcS);
+	if(size < 0)
+		return size;
+	if(src[0] != CPRS_DIFF8_TAG && src[0] != CPRS_DIFF16_TAG)
+		return CPRS_ERR_DATA;
+	if(srcS-4 < (uint)size || (src[0] == CPRS_DIFF16_TAG && (size&1)))
+		return CPRS_ERR_DATA;
+	if(dstS < (uint)size)
+		return CPRS_ERR_SPACE;
+
+	if(src[0] == CPRS_DIFF16_TAG)
+		Diff16Unfilter(dst, src+4, size);
+	else
+		Diff8Unfilter(dst, src+4, size);
+
+	return size;
+}
+
+/* Diff8Filter() **********************
+   dst[ii]= src[ii]-src[ii-1], 16 bytes at a time where possible.
+*/
+void Diff8Filter(BYTE *dst, const BYTE *src, uint srcS)
+{
+	uint ii= 1;
+
+	if(srcS == 0)
+		return;
+	dst[0]= src[0];
+
+#ifdef __SSE2__
+	for( ; ii+16 <= srcS; ii += 16)
+		_mm_storeu_si128((__m128i*)&dst[ii], _mm_sub_epi8(
+			_mm_loadu_si128((const __m128i*)&src[ii]), 
+			_mm_loadu_si128((const __m128i*)&src[ii-1])));
+#endif
+	for( ; ii<srcS; ii++)
+		dst[ii]= src[ii] - src[ii-1];
+}
+
+/* Diff16Filter() *********************
+   The same for little-endian halfwords; srcS is even.
+*/
+void Diff16Filter(BYTE *dst, const BYTE *src, uint srcS)
+{
+	uint ii= 2;
+
+	if(srcS == 0)
+		return;
+	dst[0]= src[0];
+	dst[1]= src[1];
+
+#ifdef __SSE2__
+	for( ; ii+16 <= srcS; ii += 16)
+		_mm_storeu_si128((__m128i*)&dst[ii], _mm_sub_epi16(
+			_mm_loadu_si128((const __m128i*)&src[ii]), 
+			_mm_loadu_si128((const __m128i*)&src[ii-2])));
+#endif
+	for( ; ii<srcS; ii += 2)
+		write16le(&dst[ii], (src[ii] | src[ii+1]<<8) - 
+			(src[ii-2] | src[ii-1]<<8));
+}
+
+/* Diff8Unfilter() ********************
+   Running sum of src. With SSE2, each block of 16 is summed in 
+   log2(16) shifted adds, after which the total so far is added in.
+*/
+void Diff8Unfilter(BYTE *dst, const BYTE *src, uint srcS)
+{
+	uint ii= 0;
+	BYTE sum= 0;
+
+#ifdef __SSE2__
+	__m128i x, carry= _mm_setzero_si128();
+	for( ; ii+16 <= srcS; ii += 16)
+	{
+		x= _mm_loadu_si128((const __m128i*)&src[ii]);
+		x= _mm_add_epi8(x, _mm_slli_si128(x, 1));
+		x= _mm_add_epi8(x, _mm_slli_si128(x, 2));
+		x= _mm_add_epi8(x, _mm_slli_si128(x, 4));
+		x= _mm_add_epi8(x, _mm_slli_si128(x, 8));
+		x= _mm_add_epi8(x, carry);
+		_mm_storeu_si128((__m128i*)&dst[ii], x);
+
+		// Spread the last byte over the register.
+		carry= _mm_srli_si128(x, 15);
+		carry= _mm_unpacklo_epi8(carry, carry);
+		carry= _mm_shuffle_epi32(_mm_shufflelo_epi16(carry, 0), 0);
+	}
+	if(ii > 0)
+		sum= dst[ii-1];
+#endif
+	for( ; ii<srcS; ii++)
+		dst[ii]= sum += src[ii];
+}
+
+/* Diff16Unfilter() *******************
+   The same for little-endian halfwords; srcS is even.
+*/
+void Diff16Unfilter(BYTE *dst, const BYTE *src, uint srcS)
+{
+	uint ii= 0;
+	WORD sum= 0;
+
+#ifdef __SSE2__
+	__m128i x, carry= _mm_setzero_si128();
+	for( ; ii+16 <= srcS; ii += 16)
+	{
+		x= _mm_loadu_si128((const __m128i*)&src[ii]);
+		x= _mm_add_epi16(x, _mm_slli_si128(x, 2));
+		x= _mm_add_epi16(x, _mm_slli_si128(x, 4));
+		x= _mm_add_epi16(x, _mm_slli_si128(x, 8));
+		x= _mm_add_epi16(x, carry);
+		_mm_storeu_si128((__m128i*)&dst[ii], x);
+
+		carry= _mm_srli_si128(x, 14);
+		carry= _mm_shuffle_epi32(_mm_shufflelo_epi16(carry, 0), 0);
+	}
+	if(ii > 0)
+		sum= dst[ii-2] | dst[ii-1]<<8;
+#endif
+	for( ; ii<srcS; ii += 2)
+	{
+		sum += src[ii] | src[ii+1]<<8;
+		write16le(&dst[ii], sum);
+	}
+}
+
+// EOF
@@ -101,6 +101,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
+#include <pthread.h>
 
 #include "cprs.h"
 
@@ -122,30 +123,152 @@
 #define TEXT_BUF_CLEAR     0   // byte to initialize the area before text_buf with
 #define NMASK           (RING_MAX-1)  // for wrapping
 
+#define HASH_BITS         13   // hash-chain heads for levels 1-9
+#define HASH_SIZE       (1<<HASH_BITS)
+#define HASH_NONE          0   // empty head/prev entry
 
-// --------------------------------------------------------------------
-// GLOBALS
-// --------------------------------------------------------------------
+#define LZ_GROUP_MAX      17   // flag byte + 8 matches
+#define LZ_FAST_MARGIN   160   // >= 8 matches plus copy overshoot
 
-/* Compressor global variables.  If you actually want to USE this
-   code in a non-trivial app, put these global variables in a struct,
-   as the Allegro library did.
-*/
-static unsigned long int codesize = 0;  // code size counter
+#define OPT_BLOCK     0x10000  // positions per optimal-parse block
+#define OPT_DEPTH         256  // max binary tree search depth
+
+#define PAR_CHUNK     0x40000  // input bytes per job for lz77gba_compress_mt()
+                               //   and per step of a stream
+#define PAR_CHUNK_OUT (4 + PAR_CHUNK + PAR_CHUNK/8)  // worst case output
 
-// Ring buffer of size RING_MAX with extra FRAME_MAX-1 bytes to 
-// facilitate string comparison
-static BYTE text_buf[RING_MAX + FRAME_MAX - 1];
-static int match_position;  // global string match position
-static int match_length;  // global string match length
 
+//! Match finder settings per compression level.
+/*!	Level 0 is the original binary tree search. The others use hash 
+	chains: \a chain is how many candidates to look at per position, 
+	\a lazy is the match length below which the next position is 
+	tried as well before committing (0 for a plain greedy parse).
+*/
+static const struct
+{
+	int chain;
+	int lazy;
+} cLz77Levels[CPRS_LEVEL_MAX+1]= 
+{
+	{    0,  0 },		// binary trees
+	{    4,  0 },
+	{    8,  0 },
+	{   32,  0 },
+	{   16,  6 },
+	{   32,  8 },
+	{   64, 12 },
+	{  256, 16 },
+	{ 1024, FRAME_MAX },
+	{ RING_MAX, FRAME_MAX },
+};
 
-// left & right children & parents -- These constitute binary search trees.
-static int lson[RING_MAX+1], rson[RING_MAX+256+1], dad[RING_MAX+1];  
 
+// --------------------------------------------------------------------
+// CONTEXT
+// --------------------------------------------------------------------
+
+/* Compressor state. This used to be a pile of file-scope globals, 
+   which made the compressor unusable from more than one thread at 
+   a time. It's all in here now; create one per thread and reuse it 
+   for as many compressions as you like.
+*/
+struct LZ77CTX
+{
+	unsigned long int codesize;  // code size counter
+
+	// Ring buffer of size RING_MAX with extra FRAME_MAX-1 bytes to 
+	// facilitate string comparison
+	BYTE text_buf[RING_MAX + FRAME_MAX - 1];
+	int match_position;  // string match position
+	int match_length;  // string match length
+
+	// left & right children & parents -- These constitute binary search trees.
+	int lson[RING_MAX+1], rson[RING_MAX+256+1], dad[RING_MAX+1];  
+
+	const BYTE *InBuf;
+	BYTE *OutBuf;
+	int InSize, OutSize, InOffset;
+	int InStart;	// InBuf[0..InStart> is history: matched against, not output
+	int OutCap;		// OutBuf size; a multiple of 4
+	int overflow;	// set when OutCap was about to be exceeded
+	const uint *limit;	// give up past this size; other threads lower it
+
+	// Number of ring positions touched by the last run; only those 
+	// need to be cleaned up before the next one.
+	int dirty;
+
+	// Hash chains. Entries are input offsets plus hash_base, so
+	// anything below hash_base belongs to an earlier run and counts 
+	// as empty; that way a reused context needn't clear head[].
+	u32 head[HASH_SIZE];
+	u32 prev[RING_MAX];
+	u32 son[2*RING_MAX];	// binary trees hanging off head[] (optimal parse)
+	u32 hash_base;
+	int chain, lazy;
+
+	int vram;		// VRAM safe output: no matches at distance 1
+
+	// Flag byte of the current group of 8 tokens
+	int flag_pos;
+	BYTE flag_mask;
+};
+
+
+//! Work shared by the lz77gba_compress_mt() threads.
+typedef struct LZ77PAR
+{
+	const BYTE *src;
+	uint srcS;
+	int level, vram;
+	BYTE *out;		// chunk i goes to out[i*stride]
+	uint stride;
+	int *sizes;
+	int count, next;	// chunks; the next one to take
+	pthread_mutex_t lock;
+} LZ77PAR;
+
+
+//! Streaming compressor; see lz77gba_stream_init().
+/*!	Input is collected in \a win until there's a whole PAR_CHUNK, 
+	which is then compressed just like lz77gba_compress_mt() would, 
+	and regrouped into \a out. Only bytes before the flag byte that's
+	still open can be read.
+*/
+struct LZ77STREAM
+{
+	LZ77CTX *ctx;
+	uint size, total;	// Declared and fed sizes
+	int level, vram;
+	int done;
+
+	BYTE win[RING_MAX + PAR_CHUNK];
+	uint hist, fill;	// History and total bytes in win
+
+	BYTE chunk[PAR_CHUNK_OUT];
+	BYTE out[PAR_CHUNK_OUT + LZ_GROUP_MAX + 8];
+	uint outS, outRd;
+	uint outBase;		// Bytes read and dropped from out before
+	int flag_pos;
+	BYTE flag_mask;
+};
+
+
+//! Streaming decompressor; see lz77gba_dstream_init().
+/*!	Output goes through \a ring too, so matches can reach back into
+	earlier calls.
+*/
+struct LZ77DSTREAM
+{
+	BYTE head[4];		// Header, as far as it's come in
+	uint headS;
+	uint size, done;	// Output size and how much of it is out
 
-static BYTE *InBuf, *OutBuf;
-static int InSize, OutSize, InOffset;
+	BYTE ring[RING_MAX];
+	BYTE flags, mask;	// Current flag byte; mask==0: need a new one
+	BYTE token;			// First byte of a match, while waiting for the second
+	int  half;			// ... in which case this is set
+	uint count, ofs;	// Match still being copied
+};
 
 
 // --------------------------------------------------------------------
@@ -153,14 +276,49 @@ static int InSize, OutSize, InOffset;
 // --------------------------------------------------------------------
 
 
+/* Wide copies for the decoder. A match copy may write up to 13 bytes
+   past the end of the match. */
+INLINE void copy8(BYTE *dst, const BYTE *src)
+{	memcpy(dst, src, 8);	}
+
+INLINE void copy16(BYTE *dst, const BYTE *src)
+{	memcpy(dst, src, 16);	}
+
+INLINE void copy_match(BYTE *dst, uint ofs, uint count);
+
+
 /* Binary search tree functions */
-static void InitTree(void);
-static void InsertNode(int r);
-static void DeleteNode(int p);
+static void InitTree(LZ77CTX *ctx);
+static void ClearTree(LZ77CTX *ctx);
+static void InsertNode(LZ77CTX *ctx, int r);
+static void DeleteNode(LZ77CTX *ctx, int p);
+
+/* Hash chain functions */
+static void HashInsert(LZ77CTX *ctx, int pos);
+static int HashMatch(LZ77CTX *ctx, int pos, int *dist);
+static void HashRetire(LZ77CTX *ctx);
+static int TreeMatch(LZ77CTX *ctx, int pos, int *dist);
+
+/* Token output */
+INLINE int OverLimit(const LZ77CTX *ctx);
+static void PutLiteral(LZ77CTX *ctx, BYTE c);
+static void PutMatch(LZ77CTX *ctx, int len, int dist);
+
+/* Parallel compression */
+static void ParRun(LZ77PAR *par, LZ77CTX *ctx);
+static void *ParThread(void *arg);
+static void ParAppend(LZ77CTX *ctx, const BYTE *src, int size);
+
+/* Streaming */
+static uint StreamReady(const LZ77STREAM *st);
+static void StreamChunk(LZ77STREAM *st);
 
 /* Misc Functions */
-static void CompressLZ77(void);
-static int InChar(void);
+static void Compress(LZ77CTX *ctx, int level);
+static void CompressLZ77(LZ77CTX *ctx);
+static void CompressHash(LZ77CTX *ctx);
+static void CompressOptimal(LZ77CTX *ctx);
+static int InChar(LZ77CTX *ctx);
 
 
 // --------------------------------------------------------------------
@@ -168,31 +326,395 @@ static int InChar(void);
 // --------------------------------------------------------------------
 
 
-// Initializes InBuf, InSize; allocates OutBuf.
-// the rest is done in CompressLZ77.
-uint lz77gba_compress(RECORD *dst, const RECORD *src)
+//! Create a compressor context.
+/*!	\return New context, or NULL if out of memory. Free with 
+	  lz77gba_destroy().
+*/
+LZ77CTX *lz77gba_create(void)
+{
+	LZ77CTX *ctx= (LZ77CTX*)malloc(sizeof(LZ77CTX));
+	if(ctx == NULL)
+		return NULL;
+
+	lz77gba_reset(ctx);
+	return ctx;
+}
+
+//! Put \a ctx back into its pristine state.
+void lz77gba_reset(LZ77CTX *ctx)
+{
+	ctx->codesize= 0;
+	ctx->dirty= 0;
+	ctx->limit= NULL;
+	InitTree(ctx);
+	memset(ctx->text_buf, TEXT_BUF_CLEAR, sizeof(ctx->text_buf));
+
+	memset(ctx->head, HASH_NONE, sizeof(ctx->head));
+	ctx->hash_base= HASH_NONE+1;
+}
+
+//! Free a context created by lz77gba_create().
+void lz77gba_destroy(LZ77CTX *ctx)
+{
+	free(ctx);
+}
+
+//! Compress \a src with a temporary context.
+/*!	\note Use lz77gba_compress_ctx() for many small compressions.
+*/
+uint lz77gba_compress(RECORD *dst, const RECORD *src, int level, int vram)
+{
+	return lz77gba_compress_ctx(NULL, dst, src, level, vram);
+}
+
+//! Compress \a src into a newly allocated record.
+/*!	\return Size of the compressed data, or 0 on failure.
+	\sa lz77gba_compress_buf() for the parameters.
+*/
+uint lz77gba_compress_ctx(LZ77CTX *ctx, RECORD *dst, const RECORD *src, int level, int vram)
 {
 	// Fail on the obvious
 	if(src==NULL || src->data==NULL || dst==NULL)
 		return 0;
-	
-	InSize= rec_size(src);
-	OutSize = InSize + InSize/8 + 16;
-	OutBuf = (BYTE*)malloc(OutSize);
-	if(OutBuf == NULL)
+
+	uint srcS= rec_size(src), dstS= cprs_compress_bound(srcS, CPRS_LZ77_TAG);
+	BYTE *dstD= (BYTE*)malloc(dstS);
+	if(dstD == NULL)
 		return 0;
-	InBuf= (BYTE*)src->data;
 
-	CompressLZ77();
-	OutSize= ALIGN4(OutSize);
+	int size= lz77gba_compress_buf(ctx, dstD, dstS, src->data, srcS, level, vram);
+	if(size < 0)
+	{
+		free(dstD);
+		return 0;
+	}
+	rec_attach_fit(dst, dstD, size);
+
+	return size;
+}
+
+//! Compress \a src to GBA LZ77 in a caller-supplied buffer.
+/*!	\param ctx	Context to work with; NULL for a temporary one.
+	\param dst	Destination buffer. 
+	\param dstS	Its size; cprs_compress_bound() is always enough.
+	  With less, compression stops once the output can't be 
+	  guaranteed to fit.
+	\param level	0 (CPRS_LEVEL_DEFAULT) for the classic encoder, 
+	  1 (fastest) to 9 for the hash chain one, CPRS_LEVEL_OPTIMAL
+	  for the smallest output.
+	\param vram	Non-zero for output that LZ77UnCompVram can handle. 
+	  Zero allows matches at distance 1, which only LZ77UnCompWram 
+	  decodes properly; better for runs.
+	\return Size of the compressed data, or a negative ECprsError.
+*/
+int lz77gba_compress_buf(LZ77CTX *ctx, BYTE *dst, uint dstS, 
+	const BYTE *src, uint srcS, int level, int vram)
+{
+	return lz77gba_compress_limit(ctx, dst, dstS, src, srcS, level, vram, NULL);
+}
+
+//! Like lz77gba_compress_buf(), but giving up once the output is 
+//! past \a *limit, which other threads may lower in the meantime.
+/*!	\param limit	Size to stay within, read atomically; NULL for none.
+	\return Size of the compressed data, or a negative ECprsError;
+	  CPRS_ERR_SPACE if the limit was passed.
+	\sa cprs_compress_best().
+*/
+int lz77gba_compress_limit(LZ77CTX *ctx, BYTE *dst, uint dstS, 
+	const BYTE *src, uint srcS, int level, int vram, const uint *limit)
+{
+	LZ77CTX *tmp= NULL;
+	int size;
+
+	if(dst==NULL || (src==NULL && srcS>0) || srcS > CPRS_SIZE_MAX)
+		return CPRS_ERR_ARG;
+	if(dstS < 4)
+		return CPRS_ERR_SPACE;
+	if(ctx == NULL && (ctx= tmp= lz77gba_create()) == NULL)
+		return CPRS_ERR_MEM;
+
+	if(level < CPRS_LEVEL_DEFAULT)
+		level= CPRS_LEVEL_DEFAULT;
+	else if(level > CPRS_LEVEL_OPTIMAL)
+		level= CPRS_LEVEL_OPTIMAL;
+
+	ctx->InBuf= src;
+	ctx->InSize= srcS;
+	ctx->InStart= 0;
+	ctx->OutBuf= dst;
+	ctx->OutCap= dstS&~3;
+	ctx->overflow= 0;
+	ctx->limit= limit;
+	ctx->vram= vram;
+
+	write32le(dst, cprs_create_header(srcS, CPRS_LZ77_TAG));
+	Compress(ctx, level);
+	ctx->limit= NULL;
+
+	if(ctx->overflow)
+		size= CPRS_ERR_SPACE;
+	else
+	{
+		// Zero the padding, or identical inputs give different outputs.
+		while(ctx->OutSize & 3)
+			ctx->OutBuf[ctx->OutSize++]= 0;
+		size= ctx->OutSize;
+	}
+
+	ctx->OutBuf= NULL;
+	ctx->InBuf= NULL;
+	lz77gba_destroy(tmp);
+
+	return size;
+}
+
+//! Compress \a src on \a threads threads into a new record.
+/*!	\return Size of the compressed data, or 0 on failure.
+	\sa lz77gba_compress_mt_buf().
+*/
+uint lz77gba_compress_mt(RECORD *dst, const RECORD *src, int level, int vram, int threads)
+{
+	if(src==NULL || src->data==NULL || dst==NULL)
+		return 0;
+
+	uint srcS= rec_size(src), dstS= cprs_compress_bound(srcS, CPRS_LZ77_TAG);
+	BYTE *dstD= (BYTE*)malloc(dstS);
+	if(dstD == NULL)
+		return 0;
+
+	int size= lz77gba_compress_mt_buf(dstD, dstS, src->data, srcS, level, vram, threads);
+	if(size < 0)
+	{
+		free(dstD);
+		return 0;
+	}
+	rec_attach_fit(dst, dstD, size);
+
+	return size;
+}
+
+//! Compress \a src to GBA LZ77 using several threads.
+/*!	The input is cut into chunks of PAR_CHUNK bytes which are 
+	compressed separately, each seeing the RING_MAX bytes before it 
+	as history, and then joined into a single stream. Chunks are 
+	always the same, so the output doesn't depend on \a threads; 
+	it's a bit bigger than that of lz77gba_compress_buf(), as 
+	matches can't cross chunk boundaries. Inputs of one chunk or 
+	less come out exactly the same.
+	\param threads	Number of threads to use, the caller's included.
+	\sa lz77gba_compress_buf() for the other parameters.
+*/
+int lz77gba_compress_mt_buf(BYTE *dst, uint dstS, 
+	const BYTE *src, uint srcS, int level, int vram, int threads)
+{
+	LZ77PAR par;
+	LZ77CTX *ctx;
+	pthread_t *tids;
+	int ii, nn= 0;
+
+	if(srcS <= PAR_CHUNK)
+		return lz77gba_compress_buf(NULL, dst, dstS, src, srcS, level, vram);
+
+	if(dst==NULL || src==NULL || srcS > CPRS_SIZE_MAX)
+		return CPRS_ERR_ARG;
+	if(dstS < 4)
+		return CPRS_ERR_SPACE;
+
+	if(level < CPRS_LEVEL_DEFAULT)
+		level= CPRS_LEVEL_DEFAULT;
+	else if(level > CPRS_LEVEL_OPTIMAL)
+		level= CPRS_LEVEL_OPTIMAL;
+
+	par.src= src;
+	par.srcS= srcS;
+	par.level= level;
+	par.vram= vram;
+	par.count= (srcS+PAR_CHUNK-1)/PAR_CHUNK;
+	par.next= 0;
+	par.stride= cprs_compress_bound(PAR_CHUNK, CPRS_LZ77_TAG);
+	par.out= (BYTE*)malloc((size_t)par.count*par.stride);
+	par.sizes= (int*)malloc(par.count*sizeof(int));
+	threads= MIN(threads, par.count) - 1;	// besides this one
+	if(threads < 0)
+		threads= 0;
+	tids= (pthread_t*)malloc((threads+1)*sizeof(pthread_t));
+	ctx= lz77gba_create();
+
+	if(par.out==NULL || par.sizes==NULL || tids==NULL || ctx==NULL)
+	{
+		free(par.out);	free(par.sizes);	free(tids);
+		lz77gba_destroy(ctx);
+		return CPRS_ERR_MEM;
+	}
+
+	// Compress the chunks. If a thread can't be had, the others 
+	// just do more of the work.
+	pthread_mutex_init(&par.lock, NULL);
+	for(ii=0; ii<threads; ii++)
+		if(pthread_create(&tids[nn], NULL, ParThread, &par) == 0)
+			nn++;
+	ParRun(&par, ctx);
+	for(ii=0; ii<nn; ii++)
+		pthread_join(tids[ii], NULL);
+	pthread_mutex_destroy(&par.lock);
+
+	// And stitch them together
+	ctx->OutBuf= dst;
+	ctx->OutCap= dstS&~3;
+	ctx->OutSize= 4;
+	ctx->flag_mask= 0;
+	ctx->overflow= 0;
+	write32le(dst, cprs_create_header(srcS, CPRS_LZ77_TAG));
+
+	for(ii=0; ii<par.count && !ctx->overflow; ii++)
+		ParAppend(ctx, &par.out[ii*par.stride + 4], par.sizes[ii]-4);
+
+	if(ctx->overflow)
+		nn= CPRS_ERR_SPACE;
+	else
+	{
+		while(ctx->OutSize & 3)
+			ctx->OutBuf[ctx->OutSize++]= 0;
+		nn= ctx->OutSize;
+	}
+
+	free(par.out);
+	free(par.sizes);
+	free(tids);
+	lz77gba_destroy(ctx);
+
+	return nn;
+}
+
+//! Start streaming LZ77 compression.
+/*!	\param size	Total size of the data that will be fed, or 
+	  CPRS_SIZE_UNKNOWN. In the latter case the header says 0 and 
+	  has to be patched afterwards.
+	\return New stream, or NULL if out of memory. Free with 
+	  lz77gba_stream_destroy().
+	\note The output is the same as that of lz77gba_compress_mt_buf().
+	  Memory use is about 1M, whatever the size.
+	\sa lz77gba_compress_buf() for the other parameters.
+*/
+LZ77STREAM *lz77gba_stream_init(uint size, int level, int vram)
+{
+	LZ77STREAM *st= (LZ77STREAM*)malloc(sizeof(LZ77STREAM));
+	if(st == NULL)
+		return NULL;
+	if((st->ctx= lz77gba_create()) == NULL)
+	{
+		free(st);
+		return NULL;
+	}
+
+	if(level < CPRS_LEVEL_DEFAULT)
+		level= CPRS_LEVEL_DEFAULT;
+	else if(level > CPRS_LEVEL_OPTIMAL)
+		level= CPRS_LEVEL_OPTIMAL;
+
+	st->size= size;
+	st->total= 0;
+	st->level= level;
+	st->vram= vram;
+	st->done= 0;
+	st->hist= st->fill= 0;
+
+	write32le(st->out, cprs_create_header(
+		size == CPRS_SIZE_UNKNOWN ? 0 : size, CPRS_LZ77_TAG));
+	st->outS= 4;
+	st->outRd= st->outBase= 0;
+	st->flag_pos= 0;
+	st->flag_mask= 0;
+
+	return st;
+}
+
+//! Feed data to a stream.
+/*!	\return Number of bytes taken, or a negative ECprsError. This 
+	  is less than \a srcS when the output needs reading first.
+*/
+int lz77gba_stream_feed(LZ77STREAM *st, const BYTE *src, uint srcS)
+{
+	uint nn, taken= 0;
+
+	if(st==NULL || (src==NULL && srcS>0) || st->done)
+		return CPRS_ERR_ARG;
+	if(st->total + srcS > MIN(st->size, CPRS_SIZE_MAX))
+		return CPRS_ERR_ARG;
+
+	while(srcS > 0)
+	{
+		if(st->fill == st->hist + PAR_CHUNK)	// Full: compress
+		{
+			if(st->outRd < StreamReady(st))
+				break;
+			StreamChunk(st);
+
+			memmove(st->win, &st->win[st->fill-RING_MAX], RING_MAX);
+			st->hist= st->fill= RING_MAX;
+		}
+
+		nn= MIN(srcS, st->hist + PAR_CHUNK - st->fill);
+		memcpy(&st->win[st->fill], src, nn);
+		st->fill += nn;
+		st->total += nn;
+		src += nn;
+		srcS -= nn;
+		taken += nn;
+	}
+
+	return taken;
+}
+
+//! Copy compressed data out of a stream.
+/*!	\return Number of bytes copied; 0 if there's nothing to read 
+	  right now.
+*/
+int lz77gba_stream_read(LZ77STREAM *st, BYTE *dst, uint dstS)
+{
+	if(st==NULL || dst==NULL)
+		return CPRS_ERR_ARG;
 
-	u8 *dstD= (u8*)malloc(OutSize);
-	memcpy(dstD, OutBuf, OutSize);
-	rec_attach(dst, dstD, 1, OutSize);
+	dstS= MIN(dstS, StreamReady(st) - st->outRd);
+	memcpy(dst, &st->out[st->outRd], dstS);
+	st->outRd += dstS;
+
+	return dstS;
+}
 
-	free(OutBuf);
+//! Signal the end of the data. 
+/*!	Whatever remains can be read with lz77gba_stream_read() after 
+	this.
+	\return 0, or a negative ECprsError: CPRS_ERR_ARG if the total
+	  doesn't match what was given to lz77gba_stream_init(), 
+	  CPRS_ERR_SPACE if the output needs reading first.
+*/
+int lz77gba_stream_finish(LZ77STREAM *st)
+{
+	if(st == NULL || st->done)
+		return CPRS_ERR_ARG;
+	if(st->size != CPRS_SIZE_UNKNOWN && st->total != st->size)
+		return CPRS_ERR_ARG;
+	if(st->outRd < StreamReady(st))
+		return CPRS_ERR_SPACE;
+
+	if(st->fill > st->hist)
+		StreamChunk(st);
+
+	while((st->outBase + st->outS) & 3)
+		st->out[st->outS++]= 0;
+	st->done= 1;
+
+	return 0;
+}
 
-	return OutSize;
+//! Free a stream.
+void lz77gba_stream_destroy(LZ77STREAM *st)
+{
+	if(st == NULL)
+		return;
+	lz77gba_destroy(st->ctx);
+	free(st);
 }
 
 //! Decompress GBA LZ77 data.
@@ -202,40 +724,284 @@ uint lz77gba_decompress(RECORD *dst, const RECORD *src)
 	if(dst==NULL || src==NULL || src->data==NULL)
 		return 0;
 
-	// Get and check header word
-	u32 header= read32le(src->data);
-	if((header&255) != CPRS_LZ77_TAG)
+	int dstS= cprs_decompress_size(src->data, rec_size(src));
+	if(dstS < 0)
 		return 0;
 
-	u32 flags;
-	int ii, jj, dstS= header>>8;
-	u8 *srcL= src->data+4, *dstD= (BYTE*)malloc(dstS);
+	BYTE *dstD= (BYTE*)malloc(dstS);
+	if(dstD == NULL)
+		return 0;
 
-	for(ii=0, jj=-1; ii<dstS; jj--)
+	if(lz77gba_decompress_buf(dstD, dstS, src->data, rec_size(src)) < 0)
 	{
-		if(jj<0)				// Get block flags
+		free(dstD);
+		return 0;
+	}
+
+	rec_attach(dst, dstD, 1, dstS);
+	return dstS;
+}
+
+//! Decompress GBA LZ77 data into a caller-supplied buffer.
+/*!	\param dstS	Size of \a dst; at least cprs_decompress_size().
+	\return Size of the decompressed data, or a negative ECprsError.
+	\note Malformed data (truncated, or matches reaching back before
+	  the start) gives CPRS_ERR_DATA; a match running past the end is
+	  cut short.
+*/
+int lz77gba_decompress_buf(BYTE *dst, uint dstS, const BYTE *src, uint srcS)
+{
+	if(dst==NULL || src==NULL)
+		return CPRS_ERR_ARG;
+
+	// Get and check header word
+	if(srcS < 4 || src[0] != CPRS_LZ77_TAG)
+		return CPRS_ERR_DATA;
+
+	uint flags, mask, count, ofs, size= read32le(src)>>8;
+	const BYTE *srcL= src+4, *srcEnd= src+srcS;
+	BYTE *dstL= dst, *dstEnd= dst+size;
+
+	if(size > dstS)
+		return CPRS_ERR_SPACE;
+
+	// Fast path: as long as a whole group of tokens is in the source
+	// and the widest copies can't reach the end of dst, none of those
+	// need checking. That leaves one check per match: that it doesn't
+	// reach back before the start.
+	if(size > LZ_FAST_MARGIN && srcS >= LZ_GROUP_MAX)
+	{
+		BYTE *dstFast= dstEnd - LZ_FAST_MARGIN;
+		const BYTE *srcFast= srcEnd - LZ_GROUP_MAX;
+
+		while(dstL < dstFast && srcL <= srcFast)
 		{
 			flags= *srcL++;
-			jj= 7;
-		}
+			if(flags == 0)			// All literals
+			{
+				copy8(dstL, srcL);
+				dstL += 8;
+				srcL += 8;
+				continue;
+			}
 		
-		if(flags>>jj & 1)		// Compressed stint
+			for(mask=0x80; mask; mask >>= 1)
+			{
+				if(flags & mask)
+				{
+					count= (srcL[0]>>4)+THRESHOLD+1;
+					ofs= ((srcL[0]&15)<<8 | srcL[1])+1;
+					srcL += 2;
+					if(ofs > (uint)(dstL-dst))
+						return CPRS_ERR_DATA;
+					copy_match(dstL, ofs, count);
+					dstL += count;
+				}
+				else
+					*dstL++= *srcL++;
+			}
+		}
+	}
+
+	// The rest, checking everything
+	while(dstL < dstEnd)
+	{
+		if(srcL >= srcEnd)
+			return CPRS_ERR_DATA;
+		flags= *srcL++;
+
+		for(mask=0x80; mask && dstL < dstEnd; mask >>= 1)
 		{
-			int count= (srcL[0]>>4)+THRESHOLD+1;
-			int ofs=  ((srcL[0]&15)<<8 | srcL[1])+1;
-			srcL += 2;
-			while(count--)
+			if(flags & mask)
+			{
+				if(srcEnd-srcL < 2)
+					return CPRS_ERR_DATA;
+				count= (srcL[0]>>4)+THRESHOLD+1;
+				ofs= ((srcL[0]&15)<<8 | srcL[1])+1;
+				srcL += 2;
+				if(ofs > (uint)(dstL-dst))
+					return CPRS_ERR_DATA;
+				count= MIN(count, (uint)(dstEnd-dstL));
+				while(count--)
+				{
+					*dstL= dstL[-(int)ofs];
+					dstL++;
+				}
+			}
+			else
 			{
-				dstD[ii]= dstD[ii-ofs];
-				ii++;
+				if(srcL >= srcEnd)
+					return CPRS_ERR_DATA;
+				*dstL++= *srcL++;
 			}
 		}
-		else					// Single byte from source
-			dstD[ii++]= *srcL++;
 	}
 
-	rec_attach(dst, dstD, 1, dstS);
-	return dstS;
+	return size;
+}
+
+
+//! Start streaming LZ77 decompression.
+/*!	\return New stream, or NULL if out of memory. Free with 
+	  lz77gba_dstream_destroy().
+*/
+LZ77DSTREAM *lz77gba_dstream_init(void)
+{
+	LZ77DSTREAM *st= (LZ77DSTREAM*)malloc(sizeof(LZ77DSTREAM));
+	if(st == NULL)
+		return NULL;
+
+	st->headS= 0;
+	st->size= st->done= 0;
+	st->mask= 0;
+	st->half= 0;
+	st->count= 0;
+
+	return st;
+}
+
+//! Decompress a piece of an LZ77 stream, header included.
+/*!	Takes as much of \a src as it can use, up to filling \a dst.
+	\param used	Gets the number of bytes of \a src taken.
+	\return Number of bytes put in \a dst, or a negative ECprsError.
+	  Nothing more is taken once all the data's out; see 
+	  lz77gba_dstream_left().
+*/
+int lz77gba_dstream_decode(LZ77DSTREAM *st, BYTE *dst, uint dstS, 
+	const BYTE *src, uint srcS, uint *used)
+{
+	if(st==NULL || (dst==NULL && dstS>0) || (src==NULL && srcS>0) || used==NULL)
+		return CPRS_ERR_ARG;
+
+	const BYTE *srcL= src, *srcEnd= src+srcS;
+	BYTE *dstL= dst, *dstEnd;
+	uint done= st->done, count= st->count, ofs= st->ofs, nn;
+	BYTE flags= st->flags, mask= st->mask;
+
+	while(st->headS < 4 && srcL < srcEnd)
+		st->head[st->headS++]= *srcL++;
+	if(st->headS < 4)
+	{
+		*used= srcS;
+		return 0;
+	}
+	if(st->head[0] != CPRS_LZ77_TAG)
+		return CPRS_ERR_DATA;
+	st->size= read32le(st->head)>>8;
+	dstEnd= dst + MIN(dstS, st->size-done);
+
+	while(dstL < dstEnd)
+	{
+		if(count)				// Copy (what's left of) a match
+		{
+			nn= MIN(count, (uint)(dstEnd-dstL));
+			count -= nn;
+			for( ; nn>0; nn--, done++)
+			{
+				*dstL= st->ring[(done-ofs)&NMASK];
+				st->ring[done&NMASK]= *dstL++;
+			}
+			continue;
+		}
+
+		if(srcL >= srcEnd)
+			break;
+
+		if(mask == 0)			// Get block flags
+		{
+			flags= *srcL++;
+			mask= 0x80;
+		}
+		else if(flags & mask)	// Match
+		{
+			if(!st->half)
+			{
+				st->token= *srcL++;
+				st->half= 1;
+				continue;
+			}
+			st->half= 0;
+			count= (st->token>>4)+THRESHOLD+1;
+			ofs= ((st->token&15)<<8 | *srcL++)+1;
+			if(ofs > done)
+				return CPRS_ERR_DATA;
+			mask >>= 1;
+		}
+		else					// Literal
+		{
+			*dstL++= st->ring[done++&NMASK]= *srcL++;
+			mask >>= 1;
+		}
+	}
+
+	// A match running past the end is cut short
+	if(done == st->size)
+		count= 0;
+
+	st->done= done;
+	st->count= count;
+	st->ofs= ofs;
+	st->flags= flags;
+	st->mask= mask;
+
+	*used= srcL-src;
+	return dstL-dst;
+}
+
+//! Number of bytes still to come out of a stream, or -1 if the 
+//!   header hasn't been seen yet.
+int lz77gba_dstream_left(const LZ77DSTREAM *st)
+{
+	return st->headS < 4 ? -1 : (int)(st->size - st->done);
+}
+
+//! Free a stream.
+void lz77gba_dstream_destroy(LZ77DSTREAM *st)
+{
+	free(st);
+}
+
+
+/* copy_match() ***********************
+   Copy a match of \a count (3..18) bytes from \a ofs bytes back.
+   Distances of 8 and up can go 8 or 16 bytes at a time, as nothing
+   read hasn't been written yet. Shorter ones first spread the pattern
+   over 8 bytes, a few bytes at a time; after that the source is 8+
+   bytes behind, and it's the same thing. (The table trick is LZ4's.)
+*/
+INLINE void copy_match(BYTE *dst, uint ofs, uint count)
+{
+	static const int inc[8]= { 0, 1, 2, 1, 0, 4, 4, 4 };
+	static const int dec[8]= { 0, 0, 0, -1, -4, 1, 2, 3 };
+	const BYTE *src= dst-ofs;
+
+	if(ofs >= 16)
+	{
+		copy16(dst, src);
+		if(count > 16)
+			copy8(dst+16, src+16);
+		return;
+	}
+
+	if(ofs < 8)
+	{
+		dst[0]= src[0];
+		dst[1]= src[1];
+		dst[2]= src[2];
+		dst[3]= src[3];
+		src += inc[ofs];
+		memcpy(dst+4, src, 4);
+		src -= dec[ofs];		// src is now 8+ bytes behind dst+8
+	}
+	else
+	{
+		copy8(dst, src);
+		src += 8;
+	}
+
+	copy8(dst+8, src);
+	if(count > 16)
+		copy8(dst+16, src+8);
 }
 
 
@@ -250,151 +1016,202 @@ uint lz77gba_decompress(RECORD *dst, const RECORD *src)
    for strings that begin with character i.  These are
    initialized to NIL.  Note there are 256 trees.
 */
-void InitTree(void)
+void InitTree(LZ77CTX *ctx)
 {
 	int  i;
 	for(i= RING_MAX+1; i <= RING_MAX+256; i++)
-		rson[i]= NIL;
+		ctx->rson[i]= NIL;
 	for(i=0; i < RING_MAX; i++)
-		dad[i]= NIL;
+		ctx->dad[i]= NIL;
+}
+
+/* ClearTree() *************************
+   Undo what the previous run did to the trees and the ring buffer, so
+   a reused context behaves exactly like a fresh one. Input byte k 
+   lands at ring position (RING_MAX-FRAME_MAX+k)&NMASK, so a small 
+   input only dirties a handful of positions; cleaning those up is a 
+   lot cheaper than InitTree() plus clearing all of text_buf.
+*/
+void ClearTree(LZ77CTX *ctx)
+{
+	int  i, p;
+
+	if(ctx->dirty >= RING_MAX)
+	{
+		lz77gba_reset(ctx);
+		return;
+	}
+
+	for(i= RING_MAX+1; i <= RING_MAX+256; i++)
+		ctx->rson[i]= NIL;
+	for(i=0; i < ctx->dirty; i++)
+	{
+		p= (RING_MAX-FRAME_MAX+i)&NMASK;
+		ctx->dad[p]= NIL;
+		ctx->text_buf[p]= TEXT_BUF_CLEAR;
+		if(p < FRAME_MAX-1)
+			ctx->text_buf[p+RING_MAX]= TEXT_BUF_CLEAR;
+	}
+	ctx->dirty= 0;
 }
 
 /* InsertNode() ************************
    Inserts string of length FRAME_MAX, text_buf[r..r+FRAME_MAX-1], into one of the
    trees (text_buf[r]'th tree) and returns the longest-match position
-   and length via the global variables match_position and match_length.
+   and length via ctx->match_position and ctx->match_length.
    If match_length = FRAME_MAX, then removes the old node in favor of the new
    one, because the old one will be deleted sooner.
    Note r plays double role, as tree node and position in buffer.
 */
-void InsertNode(int r)
+void InsertNode(LZ77CTX *ctx, int r)
 {
 	int  i, p, cmp, prev_length;
 	BYTE *key;
 
-	cmp= 1;  key= &text_buf[r];  p= RING_MAX + 1 + key[0];
-	rson[r]= lson[r]= NIL;  
-	prev_length= match_length= 0;
+	cmp= 1;  key= &ctx->text_buf[r];  p= RING_MAX + 1 + key[0];
+	ctx->rson[r]= ctx->lson[r]= NIL;  
+	prev_length= ctx->match_length= 0;
 	for( ; ; )
 	{
 		if(cmp >= 0)
 		{
-			if(rson[p] != NIL)
-				p= rson[p];
+			if(ctx->rson[p] != NIL)
+				p= ctx->rson[p];
 			else
 			{
-				rson[p]= r;
-				dad[r]= p;
+				ctx->rson[p]= r;
+				ctx->dad[r]= p;
 				return;
 			}
 		}
 		else
 		{
-			if(lson[p] != NIL)
-				p= lson[p];
+			if(ctx->lson[p] != NIL)
+				p= ctx->lson[p];
 			else
 			{
-				lson[p]= r;
-				dad[r]= p;
+				ctx->lson[p]= r;
+				ctx->dad[r]= p;
 				return;
 			}
 
 		}
 		for(i=1; i < FRAME_MAX; i++)
-			if((cmp = key[i] - text_buf[p + i]) != 0)
+			if((cmp = key[i] - ctx->text_buf[p + i]) != 0)
 				break;
 
-		if(i > match_length)
+		if(i > ctx->match_length)
 		{
 			// VRAM safety:
 			// match_length= i ONLY if the matched position 
 			// isn't the previous one (r-1)
 			// for normal case, remove the if.
 			// That's _IT_?!? Yup, that's it.
-			if(p != ((r-1)&NMASK) )
+			if(!ctx->vram || p != ((r-1)&NMASK) )
 			{
-				match_length= i;
-				match_position= p;
+				ctx->match_length= i;
+				ctx->match_position= p;
 			}
-			if(match_length >= FRAME_MAX)
+			if(ctx->match_length >= FRAME_MAX)
 				break;
 		}
 	}
 
 	// Full length match, remove old node in favor of this one
-	dad[r]= dad[p];
-	lson[r]= lson[p];
-	rson[r]= rson[p];
-	dad[lson[p]]= r;
-	dad[rson[p]]= r;
-	if(rson[dad[p]] == p)
-		rson[dad[p]]= r;
+	ctx->dad[r]= ctx->dad[p];
+	ctx->lson[r]= ctx->lson[p];
+	ctx->rson[r]= ctx->rson[p];
+	ctx->dad[ctx->lson[p]]= r;
+	ctx->dad[ctx->rson[p]]= r;
+	if(ctx->rson[ctx->dad[p]] == p)
+		ctx->rson[ctx->dad[p]]= r;
 	else
-		lson[dad[p]]= r;
-	dad[p]= NIL;
+		ctx->lson[ctx->dad[p]]= r;
+	ctx->dad[p]= NIL;
 }
 
 
 /* DeleteNode() ************************
    Deletes node p from the tree.
 */
-void DeleteNode(int p)  
+void DeleteNode(LZ77CTX *ctx, int p)  
 {
 	int  q;
 
-	if(dad[p] == NIL)
+	if(ctx->dad[p] == NIL)
 		return;  /* not in tree */
-	if(rson[p] == NIL)
-		q = lson[p];
-	else if(lson[p] == NIL)
-		q = rson[p];
+	if(ctx->rson[p] == NIL)
+		q = ctx->lson[p];
+	else if(ctx->lson[p] == NIL)
+		q = ctx->rson[p];
 	else
 	{
-		q = lson[p];
-		if(rson[q] != NIL)
+		q = ctx->lson[p];
+		if(ctx->rson[q] != NIL)
 		{
 			do {
-				q = rson[q];
-			} while(rson[q] != NIL);
+				q = ctx->rson[q];
+			} while(ctx->rson[q] != NIL);
 
-			rson[dad[q]] = lson[q];
-			dad[lson[q]] = dad[q];
-			lson[q] = lson[p];
-			dad[lson[p]] = q;
+			ctx->rson[ctx->dad[q]] = ctx->lson[q];
+			ctx->dad[ctx->lson[q]] = ctx->dad[q];
+			ctx->lson[q] = ctx->lson[p];
+			ctx->dad[ctx->lson[p]] = q;
 		}
-		rson[q] = rson[p];
-		dad[rson[p]] = q;
+		ctx->rson[q] = ctx->rson[p];
+		ctx->dad[ctx->rson[p]] = q;
 	}
 
-	dad[q] = dad[p];
+	ctx->dad[q] = ctx->dad[p];
 
-	if(rson[dad[p]] == p)
-		rson[dad[p]] = q;
+	if(ctx->rson[ctx->dad[p]] == p)
+		ctx->rson[ctx->dad[p]] = q;
 	else
-		lson[dad[p]] = q;
+		ctx->lson[ctx->dad[p]] = q;
 
-	dad[p] = NIL;
+	ctx->dad[p] = NIL;
 }
 
 
+/* Compress() **************************
+   Run the encoder for \a level (already clamped) over the input set 
+   up in ctx. Output starts at OutBuf+4.
+*/
+void Compress(LZ77CTX *ctx, int level)
+{
+	if(level == CPRS_LEVEL_DEFAULT)
+	{
+		ClearTree(ctx);
+		CompressLZ77(ctx);
+	}
+	else if(level == CPRS_LEVEL_OPTIMAL)
+		CompressOptimal(ctx);
+	else
+	{
+		ctx->chain= cLz77Levels[level].chain;
+		ctx->lazy= cLz77Levels[level].lazy;
+		CompressHash(ctx);
+	}
+}
+
 /* CompressLZ77() **********************
-   Compress InBuffer to OutBuffer.
+   Compress InBuffer to OutBuffer. The header is already in place.
+   History goes into the ring buffer and trees first, as much of it 
+   as fits next to the look-ahead.
 */
 
-void CompressLZ77(void)
+void CompressLZ77(LZ77CTX *ctx)
 {
-	int  i, c, len, r, s, last_match_length, code_buf_ptr;
+	int  i, c, len, r, s, h, last_match_length, code_buf_ptr;
 	unsigned char  code_buf[17];
 	unsigned short mask;
-	BYTE *FileSize;
 	unsigned int curmatch;		// PONDER: doesn't this do what r does?
 	unsigned int savematch;
 
-	OutSize=4;  // skip the compression type and file size
-	InOffset=0;
-	match_position= curmatch= RING_MAX-FRAME_MAX;
+	ctx->OutSize=4;  // skip the compression type and file size
+	ctx->InOffset=0;
+	ctx->match_position= curmatch= RING_MAX-FRAME_MAX;
 
-	InitTree();  // initialize trees
 	code_buf[0] = 0;  /* code_buf[1..16] saves eight units of code, and
 	code_buf[0] works as eight flags, "0" representing that the unit
 	is an unencoded letter (1 byte), "1" a position-and-length pair
@@ -402,15 +1219,26 @@ void CompressLZ77(void)
 	code_buf_ptr = 1;
 	s = 0;  r = RING_MAX - FRAME_MAX;
 
-	// Clear the buffer
-	for(i = s; i < r; i++)
-		text_buf[i] = TEXT_BUF_CLEAR;
+	// History goes right before r
+	h= MIN(ctx->InStart, RING_MAX-FRAME_MAX);
+	ctx->InOffset= ctx->InStart-h;
+	for(i= r-h; i < r; i++)
+	{
+		ctx->text_buf[i]= InChar(ctx);
+		if(i < FRAME_MAX-1)
+			ctx->text_buf[i + RING_MAX]= ctx->text_buf[i];
+	}
+
 	// Read FRAME_MAX bytes into the last FRAME_MAX bytes of the buffer
-	for(len = 0; len < FRAME_MAX && (c = InChar()) != -1; len++)
-		text_buf[r + len] = c;  
+	for(len = 0; len < FRAME_MAX && (c = InChar(ctx)) != -1; len++)
+		ctx->text_buf[r + len] = c;  
+	ctx->dirty= h ? RING_MAX : ctx->InSize;
 	if(len == 0)
 		return;
 
+	for(i= r-h; i < r; i++)
+		InsertNode(ctx, i);
+
 	/* Insert the F strings, each of which begins with one or more 
 	// 'space' characters.  Note the order in which these strings are 
 	// inserted.  This way, degenerate trees will be less likely to occur. 
@@ -419,46 +1247,51 @@ void CompressLZ77(void)
 	// However, the strings you create here have no relation to 
 	// the actual data and are therefore completely bogus. Removed!
 	//for (i = 1; i <= FRAME_MAX; i++)
-	//	InsertNode(r - i);
+	//	InsertNode(ctx, r - i);
 
 	// Create the first node, sets match_length to 0
-	InsertNode(r);
+	InsertNode(ctx, r);
 
 	// GBA LZSS masks are big-endian
 	mask = 0x80;
 	do
 	{
-		if(match_length > len) 
-			match_length = len;  
+		if(ctx->match_length > len) 
+			ctx->match_length = len;  
 
 		// match too short: add one unencoded byte
-		if(match_length <= THRESHOLD)
+		if(ctx->match_length <= THRESHOLD)
 		{
-			match_length = 1;
-			code_buf[code_buf_ptr++] = text_buf[r];
+			ctx->match_length = 1;
+			code_buf[code_buf_ptr++] = ctx->text_buf[r];
 		} 
 		else	// Long enough: add position and length pair.
 		{
 			code_buf[0] |= mask;	// set match flag
 
 			// 0 byte is 4:length and 4:top 4 bits of match_position
-			savematch= ((curmatch-match_position)&NMASK)-1;
+			savematch= ((curmatch-ctx->match_position)&NMASK)-1;
 			code_buf[code_buf_ptr++] = ((BYTE)((savematch>>8)&0xf))
-				| ((match_length - (THRESHOLD + 1))<<4);
+				| ((ctx->match_length - (THRESHOLD + 1))<<4);
 
 			code_buf[code_buf_ptr++] = (BYTE)savematch;
 		}
-		curmatch += match_length;
+		curmatch += ctx->match_length;
 		curmatch &= NMASK;
 
 		// if mask is empty, the buffer's full; write it out the code buffer
 		// at end of source, code_buf_ptr will be <17
 		if((mask >>= 1) == 0) 
 		{  
+			if(ctx->OutSize + code_buf_ptr > ctx->OutCap || OverLimit(ctx))
+			{
+				ctx->overflow= 1;
+				return;
+			}
 			for(i=0; i < code_buf_ptr; i++)
-				OutBuf[OutSize++]= code_buf[i];
+				ctx->OutBuf[ctx->OutSize++]= code_buf[i];
 
-			codesize += code_buf_ptr;
+			ctx->codesize += code_buf_ptr;
 			code_buf[0] = 0;  
 			code_buf_ptr = 1;
 			mask = 0x80;
@@ -466,57 +1299,541 @@ void CompressLZ77(void)
 
 		// Inserts nodes for this match. The last_match_length is 
 		// required because InsertNode changes match_length.
-		last_match_length = match_length;
-		for(i=0; i < last_match_length && (c = InChar()) != -1; i++) 
+		last_match_length = ctx->match_length;
+		for(i=0; i < last_match_length && (c = InChar(ctx)) != -1; i++) 
 		{
-			DeleteNode(s);      // Delete string beforelook-ahead
-			text_buf[s] = c;    // place new bytes
+			DeleteNode(ctx, s);      // Delete string beforelook-ahead
+			ctx->text_buf[s] = c;    // place new bytes
 			// text_buf[N..RING_MAX+FRAME_MAX> is a double for text_buf[0..FRAME_MAX>
 			// for easier string comparison
 			if(s < FRAME_MAX-1)
-				text_buf[s + RING_MAX] = c;
+				ctx->text_buf[s + RING_MAX] = c;
 
 			// add and wrap around the buffer
 			s = (s + 1) & NMASK;
 			r = (r + 1) & NMASK;
 
 			// Register the string in text_buf[r..r+FRAME_MAX-1]
-			InsertNode(r);
+			InsertNode(ctx, r);
 		}
 
 		while(i++ < last_match_length) 
 		{    
 			// After the end of text
-			DeleteNode(s);            // no need to read, but
+			DeleteNode(ctx, s);            // no need to read, but
 			s = (s + 1) & NMASK;
 			r = (r + 1) & NMASK;
 			if(--len)
-				InsertNode(r);        // buffer may not be empty
+				InsertNode(ctx, r);        // buffer may not be empty
 		}
 	} while(len > 0);    // until length of string to be processed is zero
 
 	if(code_buf_ptr > 1) 
 	{     
 		// Send remaining code.
+		if(ctx->OutSize + code_buf_ptr > ctx->OutCap)
+		{
+			ctx->overflow= 1;
+			return;
+		}
 		for(i=0; i < code_buf_ptr; i++) 
-			OutBuf[OutSize++]=code_buf[i]; 
+			ctx->OutBuf[ctx->OutSize++]=code_buf[i]; 
 
-		codesize += code_buf_ptr;
+		ctx->codesize += code_buf_ptr;
 	}
+}
+
+/* HashInsert() ***********************
+   Put InBuf[pos..pos+2] at the head of its hash chain. The chain of 
+   pos gets overwritten RING_MAX positions later, when it's out of 
+   reach anyway.
+*/
+INLINE u32 Hash3(const BYTE *key)
+{
+	return ((key[0]<<16 | key[1]<<8 | key[2])*2654435761u) >> (32-HASH_BITS);
+}
+
+void HashInsert(LZ77CTX *ctx, int pos)
+{
+	if(pos+THRESHOLD >= ctx->InSize)
+		return;
+
+	u32 h= Hash3(&ctx->InBuf[pos]);
+	ctx->prev[pos&NMASK]= ctx->head[h];
+	ctx->head[h]= pos + ctx->hash_base;
+}
+
+/* HashMatch() ************************
+   Find the longest match for InBuf[pos..] by walking at most 
+   ctx->chain links of its hash chain. Returns the length (0 if 
+   nothing longer than THRESHOLD turned up) and the distance in 
+   *dist. Must be called before HashInsert(ctx, pos). 
+   Same VRAM safety rule as InsertNode(): if ctx->vram is set, never 
+   match pos-1.
+*/
+int HashMatch(LZ77CTX *ctx, int pos, int *dist)
+{
+	const BYTE *buf= ctx->InBuf, *key= &buf[pos];
+	int  i, cand, best= THRESHOLD, best_pos= 0;
+	int  max= MIN(FRAME_MAX, ctx->InSize-pos);
+	int  chain= ctx->chain;
+	u32  link;
+
+	if(max <= THRESHOLD)
+		return 0;
 
-	FileSize= (BYTE*)OutBuf;
-	FileSize[0]= CPRS_LZ77_TAG;
-	FileSize[1]= ((InSize>>0)&0xFF);
-	FileSize[2]= ((InSize>>8)&0xFF);
-	FileSize[3]= ((InSize>>16)&0xFF);
+	for(link= ctx->head[Hash3(key)]; link >= ctx->hash_base && chain--; 
+		link= ctx->prev[cand&NMASK])
+	{
+		cand= link - ctx->hash_base;
+		if(pos-cand > RING_MAX)
+			break;
+		if((ctx->vram && cand == pos-1) || buf[cand+best] != key[best])
+			continue;
+
+		for(i=0; i<max; i++)
+			if(buf[cand+i] != key[i])
+				break;
+
+		if(i > best)
+		{
+			best= i;
+			best_pos= cand;
+			if(best >= max)
+				break;
+		}
+	}
+
+	if(best <= THRESHOLD)
+		return 0;
+
+	*dist= pos-best_pos;
+	return best;
+}
+
+/* OverLimit() ************************
+   Whether the output so far is past ctx->limit. Checked once per 
+   flag byte, which is often enough to stop early and rare enough 
+   not to cost anything.
+*/
+INLINE int OverLimit(const LZ77CTX *ctx)
+{
+	return ctx->limit != NULL && 
+		(uint)ctx->OutSize > __atomic_load_n(ctx->limit, __ATOMIC_RELAXED);
+}
+
+/* PutLiteral(), PutMatch() ***********
+   Append a token to OutBuf, starting a new flag byte every 8 tokens.
+   GBA LZSS masks are big-endian. If the token (\a size bytes, plus
+   maybe a new flag byte) doesn't fit, ctx->overflow is set and 
+   nothing gets written.
+*/
+INLINE int PutFlag(LZ77CTX *ctx, int flag, int size)
+{
+	if(ctx->OutSize + size + (ctx->flag_mask == 0) > ctx->OutCap ||
+		(ctx->flag_mask == 0 && OverLimit(ctx)))
+	{
+		ctx->overflow= 1;
+		return 0;
+	}
+	if(ctx->flag_mask == 0)
+	{
+		ctx->flag_pos= ctx->OutSize++;
+		ctx->OutBuf[ctx->flag_pos]= 0;
+		ctx->flag_mask= 0x80;
+	}
+	if(flag)
+		ctx->OutBuf[ctx->flag_pos] |= ctx->flag_mask;
+	ctx->flag_mask >>= 1;
+	return 1;
+}
+
+void PutLiteral(LZ77CTX *ctx, BYTE c)
+{
+	if(PutFlag(ctx, 0, 1))
+		ctx->OutBuf[ctx->OutSize++]= c;
+}
+
+void PutMatch(LZ77CTX *ctx, int len, int dist)
+{
+	if(!PutFlag(ctx, 1, 2))
+		return;
+	dist--;
+	ctx->OutBuf[ctx->OutSize++]= (BYTE)((len-(THRESHOLD+1))<<4 | dist>>8);
+	ctx->OutBuf[ctx->OutSize++]= (BYTE)dist;
+}
+
+/* CompressHash() *********************
+   Compress InBuf to OutBuf using the hash chains. With ctx->lazy set,
+   a match shorter than that is held back while the next position 
+   has a longer one; the current byte then goes out as a literal.
+*/
+void CompressHash(LZ77CTX *ctx)
+{
+	int  pos, len, dist, next, next_dist, i;
+
+	ctx->OutSize= 4;
+	ctx->flag_mask= 0;
+
+	for(pos=0; pos < ctx->InStart; pos++)
+		HashInsert(ctx, pos);
+
+	for( ; pos < ctx->InSize && !ctx->overflow; )
+	{
+		len= HashMatch(ctx, pos, &dist);
+		HashInsert(ctx, pos);
+
+		while(len > 0 && len < ctx->lazy)
+		{
+			next= HashMatch(ctx, pos+1, &next_dist);
+			if(next <= len)
+				break;
+
+			PutLiteral(ctx, ctx->InBuf[pos++]);
+			HashInsert(ctx, pos);
+			len= next;
+			dist= next_dist;
+		}
+
+		if(len > 0)
+		{
+			PutMatch(ctx, len, dist);
+			for(i=1; i<len; i++)
+				HashInsert(ctx, pos+i);
+			pos += len;
+		}
+		else
+			PutLiteral(ctx, ctx->InBuf[pos++]);
+	}
+
+	HashRetire(ctx);
+}
+
+/* TreeMatch() ************************
+   Insert InBuf[pos..] into the binary tree of its hash bucket and 
+   return the longest match found on the way down, like HashMatch().
+   Unlike a chain, the tree only visits the strings that sort next to
+   the key, so low entropy data doesn't blow up the search. Every 
+   position must be inserted, in order. The trees live in a window 
+   sized ring; nodes that fall out of the window are cut off, and so
+   is distance RING_MAX itself, as that node shares its slot with pos.
+   When VRAM safe, pos-1 can't be the match; since that's the usual 
+   winner inside runs, pos-2 gets a look instead.
+*/
+int TreeMatch(LZ77CTX *ctx, int pos, int *dist)
+{
+	const BYTE *buf= ctx->InBuf, *key= &buf[pos];
+	int  max= MIN(FRAME_MAX, ctx->InSize-pos);
+	int  len, len0= 0, len1= 0, best= THRESHOLD, best_pos= 0;
+	int  depth= OPT_DEPTH, cand;
+	u32  link, *pair, *ptr0, *ptr1;
+	u32  h;
+
+	if(max <= THRESHOLD)
+		return 0;
+
+	h= Hash3(key);
+	link= ctx->head[h];
+	ctx->head[h]= pos + ctx->hash_base;
+	ptr0= &ctx->son[(pos&NMASK)*2 + 1];		// where bigger strings go
+	ptr1= &ctx->son[(pos&NMASK)*2];			// where smaller strings go
+
+	for( ; ; )
+	{
+		cand= link - ctx->hash_base;
+		if(link < ctx->hash_base || pos-cand >= RING_MAX || depth-- == 0)
+		{
+			*ptr0= *ptr1= HASH_NONE;
+			break;
+		}
+
+		pair= &ctx->son[(cand&NMASK)*2];
+		len= MIN(len0, len1);
+		while(len < max && buf[cand+len] == key[len])
+			len++;
+
+		if(len > best && (!ctx->vram || cand != pos-1))
+		{
+			best= len;
+			best_pos= cand;
+		}
+
+		if(len == max)		// Full match: take over the old node
+		{
+			*ptr1= pair[0];
+			*ptr0= pair[1];
+			break;
+		}
+
+		if(buf[cand+len] < key[len])
+		{
+			*ptr1= link;
+			ptr1= &pair[1];
+			link= *ptr1;
+			len1= len;
+		}
+		else
+		{
+			*ptr0= link;
+			ptr0= &pair[0];
+			link= *ptr0;
+			len0= len;
+		}
+	}
+
+	if(ctx->vram && best < max && pos >= 2)
+	{
+		for(len=0; len<max && buf[pos-2+len] == key[len]; len++)
+			;
+		if(len > best)
+		{
+			best= len;
+			best_pos= pos-2;
+		}
+	}
+
+	if(best <= THRESHOLD)
+		return 0;
+
+	*dist= pos-best_pos;
+	return best;
+}
+
+/* CompressOptimal() ******************
+   Compress InBuf to OutBuf with the smallest possible token sequence.
+   Works in blocks of OPT_BLOCK positions to keep memory bounded: 
+   first a table of the longest match at every position (a match of 
+   length L also gives all shorter ones, at the same distance), then 
+   the cheapest parse of the block from back to front. Costs are in 
+   bits: a literal is 8+1, a match 16+1, the extra bit being the 
+   token's share of its group's flag byte. Matches don't cross block 
+   boundaries, which costs next to nothing.
+*/
+void CompressOptimal(LZ77CTX *ctx)
+{
+	int  start, end, n, i, len, dist= 0;
+	u32  best, c;
+	BYTE *lens;
+	WORD *dists;
+	u32 *cost;
+
+	n= MIN(ctx->InSize, OPT_BLOCK);
+	lens= (BYTE*)malloc(n);
+	dists= (WORD*)malloc(n*sizeof(WORD));
+	cost= (u32*)malloc((n+1)*sizeof(u32));
+
+	// Out of memory: settle for the best greedy parse.
+	if(lens==NULL || dists==NULL || cost==NULL)
+	{
+		free(lens);	free(dists);	free(cost);
+		ctx->chain= cLz77Levels[CPRS_LEVEL_MAX].chain;
+		ctx->lazy= cLz77Levels[CPRS_LEVEL_MAX].lazy;
+		CompressHash(ctx);
+		return;
+	}
+
+	ctx->OutSize= 4;
+	ctx->flag_mask= 0;
+
+	for(i=0; i < ctx->InStart; i++)
+		TreeMatch(ctx, i, &dist);
+
+	for(start=ctx->InStart; start < ctx->InSize && !ctx->overflow; start= end)
+	{
+		end= MIN(start+OPT_BLOCK, ctx->InSize);
+		n= end-start;
+
+		// Match table
+		for(i=0; i<n; i++)
+		{
+			len= TreeMatch(ctx, start+i, &dist);
+			if(len > n-i)
+				len= n-i;
+			lens[i]= len > THRESHOLD ? len : 0;
+			dists[i]= dist;
+		}
+
+		// Cheapest parse, back to front. Longer matches win ties.
+		cost[n]= 0;
+		for(i=n-1; i>=0; i--)
+		{
+			best= cost[i+1] + 9;
+			len= 1;
+			for(c=lens[i]; c > THRESHOLD; c--)
+			{
+				if(cost[i+c] + 17 < best)
+				{
+					best= cost[i+c] + 17;
+					len= c;
+				}
+			}
+			cost[i]= best;
+			lens[i]= len;
+		}
+
+		for(i=0; i<n; )
+		{
+			if(lens[i] > 1)
+			{
+				PutMatch(ctx, lens[i], dists[i]);
+				i += lens[i];
+			}
+			else
+				PutLiteral(ctx, ctx->InBuf[start + i++]);
+		}
+	}
+
+	free(lens);
+	free(dists);
+	free(cost);
+
+	HashRetire(ctx);
+}
+
+/* ParRun() ***************************
+   Compress chunks of par until there are none left. Each gets the 
+   RING_MAX bytes before it as history, and the output buffer is 
+   always big enough.
+*/
+void ParRun(LZ77PAR *par, LZ77CTX *ctx)
+{
+	int  ii;
+	uint start, end, hist;
+
+	for( ; ; )
+	{
+		pthread_mutex_lock(&par->lock);
+		ii= par->next++;
+		pthread_mutex_unlock(&par->lock);
+		if(ii >= par->count)
+			break;
+
+		start= ii*PAR_CHUNK;
+		end= MIN(start+PAR_CHUNK, par->srcS);
+		hist= MIN(start, RING_MAX);
+
+		ctx->InBuf= par->src + start-hist;
+		ctx->InSize= end-start+hist;
+		ctx->InStart= hist;
+		ctx->OutBuf= &par->out[ii*par->stride];
+		ctx->OutCap= par->stride;
+		ctx->overflow= 0;
+		ctx->vram= par->vram;
+
+		Compress(ctx, par->level);
+		par->sizes[ii]= ctx->OutSize;
+	}
+	ctx->InBuf= NULL;
+	ctx->OutBuf= NULL;
+}
+
+void *ParThread(void *arg)
+{
+	LZ77CTX *ctx= lz77gba_create();
+
+	if(ctx != NULL)
+	{
+		ParRun((LZ77PAR*)arg, ctx);
+		lz77gba_destroy(ctx);
+	}
+	return NULL;
+}
+
+/* ParAppend() ************************
+   Append the tokens of a chunk to OutBuf. Its flag bytes won't 
+   line up with ours in general, so the tokens are regrouped.
+*/
+void ParAppend(LZ77CTX *ctx, const BYTE *src, int size)
+{
+	const BYTE *end= src+size;
+	BYTE flags, mask;
+
+	while(src < end && !ctx->overflow)
+	{
+		flags= *src++;
+		for(mask=0x80; mask && src < end; mask >>= 1)
+		{
+			if(flags & mask)
+			{
+				PutMatch(ctx, (src[0]>>4)+THRESHOLD+1, 
+					((src[0]&15)<<8 | src[1])+1);
+				src += 2;
+			}
+			else
+				PutLiteral(ctx, *src++);
+		}
+	}
+}
+
+/* StreamReady() **********************
+   End of the readable part of st->out: everything up to the flag 
+   byte of an unfinished group.
+*/
+uint StreamReady(const LZ77STREAM *st)
+{
+	return (st->flag_mask && !st->done) ? (uint)st->flag_pos : st->outS;
+}
+
+/* StreamChunk() **********************
+   Compress what's in st->win and add it to st->out. Everything that
+   was readable must have been read.
+*/
+void StreamChunk(LZ77STREAM *st)
+{
+	LZ77CTX *ctx= st->ctx;
+	uint keep= st->outS - st->outRd;
+	int  chunkS;
+
+	ctx->InBuf= st->win;
+	ctx->InSize= st->fill;
+	ctx->InStart= st->hist;
+	ctx->OutBuf= st->chunk;
+	ctx->OutCap= sizeof(st->chunk)&~3;
+	ctx->overflow= 0;
+	ctx->vram= st->vram;
+	Compress(ctx, st->level);
+	chunkS= ctx->OutSize;
+
+	// Drop what's been read, then regroup the tokens onto the rest
+	memmove(st->out, &st->out[st->outRd], keep);
+	st->outBase += st->outRd;
+	st->flag_pos -= st->outRd;
+	st->outRd= 0;
+
+	ctx->OutBuf= st->out;
+	ctx->OutCap= sizeof(st->out);
+	ctx->OutSize= keep;
+	ctx->flag_pos= st->flag_pos;
+	ctx->flag_mask= st->flag_mask;
+	ParAppend(ctx, &st->chunk[4], chunkS-4);
+
+	st->outS= ctx->OutSize;
+	st->flag_pos= ctx->flag_pos;
+	st->flag_mask= ctx->flag_mask;
+	ctx->InBuf= NULL;
+	ctx->OutBuf= NULL;
+}
+
+/* HashRetire() ***********************
+   Retire this run's chain entries. Offsets stay well clear of 
+   overflow: MaxSize is 24 bits.
+*/
+void HashRetire(LZ77CTX *ctx)
+{
+	ctx->hash_base += ctx->InSize + RING_MAX;
+	if(ctx->hash_base > 0x80000000)
+	{
+		memset(ctx->head, HASH_NONE, sizeof(ctx->head));
+		ctx->hash_base= HASH_NONE+1;
+	}
 }
 
 /* InChar() ****************************
    Get the next character from the input stream, or -1 for end of file.
 */
-int InChar()
+int InChar(LZ77CTX *ctx)
 {
-	return (InOffset < InSize) ? InBuf[InOffset++] : -1;
+	return (ctx->InOffset < ctx->InSize) ? ctx->InBuf[ctx->InOffset++] : -1;
 }
 
 // EOF
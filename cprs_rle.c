@@ -55,6 +55,62 @@ THE SOFTWARE. */
 
 #include "cprs.h"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+
+// --------------------------------------------------------------------
+// TYPES
+// --------------------------------------------------------------------
+
+
+#define RLE_STREAM_IN	0x1000	// Stream input buffer size
+#define RLE_LIMIT_STEP	0x10000	// Input bytes between limit checks
+
+#define RLE_RUN_MIN		3		// Shortest compressed stint
+#define RLE_RUN_MAX		0x82	// Longest compressed stint
+#define RLE_NON_MAX		0x80	// Longest noncompressed stint
+
+struct RLESTREAM
+{
+	uint size, total;	// Declared and fed sizes
+	int done;
+
+	// Input; bytes still pending in the encoder, then new ones.
+	BYTE in[RLE_STREAM_IN];
+	uint fill;
+
+	// Output of the last feed. Worst case is a 1 byte stint per 
+	// 0x80 bytes, plus padding.
+	BYTE out[RLE_STREAM_IN + RLE_STREAM_IN/0x80 + 8];
+	uint outS, outRd, outTotal;
+};
+
+
+struct RLEDSTREAM
+{
+	BYTE head[4];		// Header, as far as it's come in
+	uint headS;
+	uint size, done;	// Output size and how much of it is out
+
+	uint count;			// Bytes left in the current stint
+	int  raw;			// Non-zero for a noncompressed stint
+	int  fill;			// Byte for a compressed one; -1 while it's coming
+};
+
+
+// --------------------------------------------------------------------
+// PROTOTYPES
+// --------------------------------------------------------------------
+
+
+static BYTE *RleScan(BYTE *dstL, BYTE *dstEnd, 
+	const BYTE *src, uint *pos, uint srcS, int final);
+INLINE uint RleFindRun(const BYTE *src, uint ii, uint end);
+INLINE uint RleRunLength(const BYTE *src, uint ii, uint end);
+static int RleOptimal(BYTE *dst, uint dstS, const BYTE *src, uint srcS);
+
 
 // --------------------------------------------------------------------
 // FUNCTIONS
@@ -62,94 +118,218 @@ THE SOFTWARE. */
 
 
 //! Compression routine for GBA RLE
-/*!
+/*!	\param level	CPRS_LEVEL_OPTIMAL for the smallest possible 
+	  output; anything else gives the classic greedy encoder.
 */
-uint rle8gba_compress(RECORD *dst, const RECORD *src)
+uint rle8gba_compress(RECORD *dst, const RECORD *src, int level)
 {
 	if(src==NULL || dst==NULL || src->data == NULL)
 		return 0;
 
-	uint ii, rle, non;
-	BYTE curr, prev;
+	uint srcS= rec_size(src), dstS= cprs_compress_bound(srcS, CPRS_RLE_TAG);
+	BYTE *dstD= (BYTE*)malloc(dstS);
+	if(dstD == NULL)
+		return 0;
+
+	int size= rle8gba_compress_buf(dstD, dstS, src->data, srcS, level);
+	if(size < 0)
+	{
+		free(dstD);
+		return 0;
+	}
+	rec_attach_fit(dst, dstD, size);
+
+	return size;
+}
+
+//! Compress to GBA RLE in a caller-supplied buffer.
+/*!	\return Size of the compressed data, or a negative ECprsError.
+*/
+int rle8gba_compress_buf(BYTE *dst, uint dstS, const BYTE *src, uint srcS, 
+	int level)
+{
+	return rle8gba_compress_limit(dst, dstS, src, srcS, level, NULL);
+}
+
+//! Like rle8gba_compress_buf(), but giving up once the output is 
+//! past \a *limit, which other threads may lower in the meantime.
+/*!	\param limit	Size to stay within, read atomically; NULL for none.
+	  The greedy encoder checks it every RLE_LIMIT_STEP bytes, the 
+	  optimal one once it knows the size.
+	\return Size of the compressed data, or a negative ECprsError;
+	  CPRS_ERR_SPACE if the limit was passed.
+	\sa cprs_compress_best().
+*/
+int rle8gba_compress_limit(BYTE *dst, uint dstS, const BYTE *src, uint srcS, 
+	int level, const uint *limit)
+{
+	uint step;
+
+	if(dst==NULL || (src==NULL && srcS>0) || srcS > CPRS_SIZE_MAX)
+		return CPRS_ERR_ARG;
+	if(dstS < 4)
+		return CPRS_ERR_SPACE;
 
-	uint srcS= src->width*src->height;
-	BYTE *srcD= src->data;
+	uint pos= 0;
 
 	// Annoyingly enough, rle _can_ end up being larger than
 	// the original. A checker-board will do it for example.
 	// if srcS is the size of the alternating pattern, then
 	// the endresult will be 4 + srcS + (srcS+0x80-1)/0x80.
-	uint dstS= 8+2*(srcS);
-	BYTE *dstD = (BYTE*)malloc(dstS), *dstL= dstD;
-	if(dstD == NULL)
-		return 0;
+	BYTE *dstL= dst+4, *dstEnd= dst + (dstS&~3);
 
-	prev= srcD[0];
-	rle= non= 1;
+	write32le(dst, cprs_create_header(srcS, CPRS_RLE_TAG));
+	if(srcS == 0)
+		return 4;
 
-	// NOTE! non will always be 1 more than the actual non-stretch
-	// PONDER: why [1,srcS] ?? (to finish up the stretch)
-	for(ii=1; ii<=srcS; ii++)
+	if(level >= CPRS_LEVEL_OPTIMAL)
 	{
-		if(ii != srcS)
-			curr= srcD[ii];
-
-		if(rle==0x82 || ii==srcS)	// stop rle
-			prev= ~curr;
-
-		if(rle<3 && (non+rle > 0x80 || ii==srcS))	// ** mini non
-		{
-			non += rle;
-			dstL[0]= non-2;	
-			memcpy(&dstL[1], &srcD[ii-non+1], non-1);
-			dstL += non;
-			non= rle= 1;
-		}
-		else if(curr == prev)		// ** start rle / non on hold
-		{
-			rle++;
-			if( rle==3 && non>1 )	// write non-1 bytes
-			{
-				dstL[0]= non-2;
-				memcpy(&dstL[1], &srcD[ii-non-1], non-1);
-				dstL += non;
-				non= 1;
-			}
-		}
-		else						// ** rle end / non start
+		int size= RleOptimal(dstL, dstEnd-dstL, src, srcS);
+		if(size < 0)
+			return size;
+		dstL += size;
+		if(limit != NULL && 
+			(uint)(dstL-dst) > __atomic_load_n(limit, __ATOMIC_RELAXED))
+			return CPRS_ERR_SPACE;
+	}
+	else
+	{
+		step= limit != NULL ? RLE_LIMIT_STEP : srcS;
+		do
 		{
-			if(rle>=3)	// write rle
-			{
-				dstL[0]= 0x80 | (rle-3);
-				dstL[1]= srcD[ii-1];
-				dstL += 2;
-				non= 0;
-				rle= 1;
-			}
-			non += rle;
-			rle= 1;
+			dstL= RleScan(dstL, dstEnd, src, &pos, 
+				MIN(pos+step, srcS), pos+step >= srcS);
+			if(dstL == NULL)
+				return CPRS_ERR_SPACE;
+			if(limit != NULL && 
+				(uint)(dstL-dst) > __atomic_load_n(limit, __ATOMIC_RELAXED))
+				return CPRS_ERR_SPACE;
 		}
-		prev= curr;
+		while(pos < srcS);
 	}
-	
-	dstS= ALIGN4(dstL-dstD)+4;
 
-	dstL= (BYTE*)malloc(dstS);
-	if(dstL == NULL)
-	{
-		free(dstD);
+	// Zero the padding, or identical inputs give different outputs.
+	while((dstL-dst) & 3)
+		*dstL++= 0;
+
+	return dstL-dst;
+}
+
+//! Start streaming RLE compression.
+/*!	\param size	Total size of the data that will be fed, or 
+	  CPRS_SIZE_UNKNOWN. In the latter case the header says 0 and 
+	  has to be patched afterwards.
+	\return New stream, or NULL if out of memory. Free with 
+	  rle8gba_stream_destroy().
+	\note The output is the same as that of rle8gba_compress_buf().
+*/
+RLESTREAM *rle8gba_stream_init(uint size)
+{
+	RLESTREAM *st= (RLESTREAM*)malloc(sizeof(RLESTREAM));
+	if(st == NULL)
+		return NULL;
+
+	st->size= size;
+	st->total= 0;
+	st->fill= 0;
+	st->done= 0;
+	write32le(st->out, cprs_create_header(
+		size == CPRS_SIZE_UNKNOWN ? 0 : size, CPRS_RLE_TAG));
+	st->outS= st->outTotal= 4;
+	st->outRd= 0;
+
+	return st;
+}
+
+//! Feed data to a stream.
+/*!	\return Number of bytes taken, or a negative ECprsError. This 
+	  is less than \a srcS when the output needs reading first.
+*/
+int rle8gba_stream_feed(RLESTREAM *st, const BYTE *src, uint srcS)
+{
+	uint pos= 0;
+
+	if(st==NULL || (src==NULL && srcS>0) || st->done)
+		return CPRS_ERR_ARG;
+	if(st->outRd < st->outS)		// Not read yet
 		return 0;
-	}
 
-	*(u32*)dstL= cprs_create_header(srcS, CPRS_RLE_TAG);
-	memcpy(dstL+4, dstD, dstS-4);
-	rec_attach(dst, dstL, 1, dstS);
+	srcS= MIN(srcS, RLE_STREAM_IN - st->fill);
+	if(st->total + srcS > MIN(st->size, CPRS_SIZE_MAX))
+		return CPRS_ERR_ARG;
+	if(srcS == 0)
+		return 0;
+
+	memcpy(&st->in[st->fill], src, srcS);
+	st->fill += srcS;
+	st->total += srcS;
+
+	st->outS= RleScan(st->out, st->out + sizeof(st->out), 
+		st->in, &pos, st->fill, 0) - st->out;
+	st->outRd= 0;
+	st->outTotal += st->outS;
+
+	// Keep what's still pending
+	st->fill -= pos;
+	memmove(st->in, &st->in[pos], st->fill);
+
+	return srcS;
+}
+
+//! Copy compressed data out of a stream.
+/*!	\return Number of bytes copied; 0 once everything's been read.
+*/
+int rle8gba_stream_read(RLESTREAM *st, BYTE *dst, uint dstS)
+{
+	if(st==NULL || dst==NULL)
+		return CPRS_ERR_ARG;
 
-	free(dstD);
+	dstS= MIN(dstS, st->outS - st->outRd);
+	memcpy(dst, &st->out[st->outRd], dstS);
+	st->outRd += dstS;
 
 	return dstS;
 }
 
+//! Signal the end of the data. 
+/*!	Whatever remains can be read with rle8gba_stream_read() after 
+	this.
+	\return 0, or a negative ECprsError: CPRS_ERR_ARG if the total
+	  doesn't match what was given to rle8gba_stream_init(), 
+	  CPRS_ERR_SPACE if the output needs reading first.
+*/
+int rle8gba_stream_finish(RLESTREAM *st)
+{
+	BYTE *dstL;
+	uint pos= 0;
+
+	if(st == NULL || st->done)
+		return CPRS_ERR_ARG;
+	if(st->size != CPRS_SIZE_UNKNOWN && st->total != st->size)
+		return CPRS_ERR_ARG;
+	if(st->outRd < st->outS)
+		return CPRS_ERR_SPACE;
+
+	dstL= RleScan(st->out, st->out + sizeof(st->out), 
+		st->in, &pos, st->fill, 1);
+
+	// The header has gone by now, but counts for alignment.
+	while((st->outTotal + (dstL - st->out)) & 3)
+		*dstL++= 0;
+	st->outS= dstL - st->out;
+	st->outRd= 0;
+	st->outTotal += st->outS;
+	st->done= 1;
+
+	return 0;
+}
+
+//! Free a stream.
+void rle8gba_stream_destroy(RLESTREAM *st)
+{
+	free(st);
+}
+
 
 uint rle8gba_decompress(RECORD *dst, const RECORD *src)
 {
@@ -157,34 +337,371 @@ uint rle8gba_decompress(RECORD *dst, const RECORD *src)
 	if(dst==NULL || src==NULL || src->data==NULL)
 		return 0;
 
-	// Get and check header word
-	u32 header= read32le(src->data);
-	if((header&255) != CPRS_RLE_TAG)
+	int dstS= cprs_decompress_size(src->data, rec_size(src));
+	if(dstS < 0)
 		return 0;
 
-	uint ii, dstS= header>>8, size=0;
-	u8 *srcL= src->data+4, *dstD= (BYTE*)malloc(dstS);
+	BYTE *dstD= (BYTE*)malloc(dstS);
+	if(dstD == NULL)
+		return 0;
 
-	for(ii=0; ii<dstS; ii += size)
+	if(rle8gba_decompress_buf(dstD, dstS, src->data, rec_size(src)) < 0)
 	{
+		free(dstD);
+		return 0;
+	}
+
+	rec_attach(dst, dstD, 1, dstS);
+	return dstS;
+}
+
+//! Decompress GBA RLE data into a caller-supplied buffer.
+/*!	\param dstS	Size of \a dst; at least cprs_decompress_size().
+	\return Size of the decompressed data, or a negative ECprsError.
+*/
+int rle8gba_decompress_buf(BYTE *dst, uint dstS, const BYTE *src, uint srcS)
+{
+	if(dst==NULL || src==NULL)
+		return CPRS_ERR_ARG;
+
+	// Get and check header word
+	if(srcS < 4 || src[0] != CPRS_RLE_TAG)
+		return CPRS_ERR_DATA;
+
+	uint header, ii, size= 0, dstSize= read32le(src)>>8;
+	const BYTE *srcL= src+4, *srcEnd= src+srcS;
+
+	if(dstSize > dstS)
+		return CPRS_ERR_SPACE;
+
+	for(ii=0; ii<dstSize; ii += size)
+	{
+		if(srcL >= srcEnd)
+			return CPRS_ERR_DATA;
+
 		// Get header byte
 		header= *srcL++;
 
 		if(header&0x80)		// compressed stint
 		{
-			size= MIN( (header&~0x80)+3, dstS-ii);
-			memset(&dstD[ii], *srcL++, size);
+			if(srcL >= srcEnd)
+				return CPRS_ERR_DATA;
+			size= MIN( (header&~0x80)+3, dstSize-ii);
+			memset(&dst[ii], *srcL++, size);
 		}
 		else				// noncompressed stint
 		{
-			size= MIN(header+1, dstS-ii);
-			memcpy(&dstD[ii], srcL, size);
+			size= MIN(header+1, dstSize-ii);
+			if(size > (uint)(srcEnd-srcL))
+				return CPRS_ERR_DATA;
+			memcpy(&dst[ii], srcL, size);
 			srcL += size;
 		}
 	}
 
-	rec_attach(dst, dstD, 1, dstS);
-	return dstS;
+	return dstSize;
+}
+
+//! Start streaming RLE decompression.
+/*!	\return New stream, or NULL if out of memory. Free with 
+	  rle8gba_dstream_destroy().
+*/
+RLEDSTREAM *rle8gba_dstream_init(void)
+{
+	RLEDSTREAM *st= (RLEDSTREAM*)malloc(sizeof(RLEDSTREAM));
+	if(st == NULL)
+		return NULL;
+
+	st->headS= 0;
+	st->size= st->done= 0;
+	st->count= 0;
+
+	return st;
+}
+
+//! Decompress a piece of an RLE stream, header included.
+/*!	\sa lz77gba_dstream_decode().
+*/
+int rle8gba_dstream_decode(RLEDSTREAM *st, BYTE *dst, uint dstS, 
+	const BYTE *src, uint srcS, uint *used)
+{
+	if(st==NULL || (dst==NULL && dstS>0) || (src==NULL && srcS>0) || used==NULL)
+		return CPRS_ERR_ARG;
+
+	const BYTE *srcL= src, *srcEnd= src+srcS;
+	BYTE *dstL= dst, *dstEnd;
+	uint header, size;
+
+	while(st->headS < 4 && srcL < srcEnd)
+		st->head[st->headS++]= *srcL++;
+	if(st->headS < 4)
+	{
+		*used= srcS;
+		return 0;
+	}
+	if(st->head[0] != CPRS_RLE_TAG)
+		return CPRS_ERR_DATA;
+	st->size= read32le(st->head)>>8;
+	dstEnd= dst + MIN(dstS, st->size-st->done);
+
+	while(dstL < dstEnd)
+	{
+		if(st->count == 0)		// Get header byte
+		{
+			if(srcL >= srcEnd)
+				break;
+			header= *srcL++;
+			st->raw= !(header&0x80);
+			st->count= st->raw ? header+1 : (header&~0x80)+3;
+			st->count= MIN(st->count, st->size - st->done - (dstL-dst));
+			st->fill= -1;
+		}
+
+		size= MIN(st->count, (uint)(dstEnd-dstL));
+		if(st->raw)				// noncompressed stint
+		{
+			size= MIN(size, (uint)(srcEnd-srcL));
+			memcpy(dstL, srcL, size);
+			srcL += size;
+		}
+		else					// compressed stint
+		{
+			if(st->fill < 0)
+			{
+				if(srcL >= srcEnd)
+					break;
+				st->fill= *srcL++;
+			}
+			memset(dstL, st->fill, size);
+		}
+		if(size == 0)
+			break;
+		dstL += size;
+		st->count -= size;
+	}
+	st->done += dstL-dst;
+
+	*used= srcL-src;
+	return dstL-dst;
+}
+
+//! Number of bytes still to come out of a stream, or -1 if the 
+//!   header hasn't been seen yet.
+int rle8gba_dstream_left(const RLEDSTREAM *st)
+{
+	return st->headS < 4 ? -1 : (int)(st->size - st->done);
+}
+
+//! Free a stream.
+void rle8gba_dstream_destroy(RLEDSTREAM *st)
+{
+	free(st);
+}
+
+/* RleScan() *************************
+   The encoder proper. Starting at src[*pos], look for the first run 
+   of RLE_RUN_MIN equal bytes within the next RLE_NON_MAX. Bytes 
+   before it go out raw, and if there isn't one, RLE_NON_MAX of them 
+   do. Then the run goes out, up to RLE_RUN_MAX long.
+     This is the same greedy parse the byte-at-a-time version did, 
+   which never starts a run straddling the end of a full 
+   noncompressed stint.
+     Unless \a final, stops where the rest depends on what comes 
+   after src[srcS-1]; *pos then tells how far it got. The bytes from
+   there on need to be passed again. Returns the new end of the 
+   output, or NULL if it doesn't fit.
+*/
+BYTE *RleScan(BYTE *dstL, BYTE *dstEnd, 
+	const BYTE *src, uint *pos, uint srcS, int final)
+{
+	uint ii= *pos, run, non, end;
+
+	while(ii < srcS)
+	{
+		end= MIN(ii+RLE_NON_MAX, srcS);
+		run= RleFindRun(src, ii, end);
+		// No run and maybe more raw bytes to come
+		if(run == end && !final && ii+RLE_NON_MAX > srcS)
+			break;
+		non= run-ii;
+		if(non > 0)
+		{
+			if(dstL + non+1 > dstEnd)
+				return NULL;
+			dstL[0]= non-1;
+			memcpy(&dstL[1], &src[ii], non);
+			dstL += non+1;
+			ii= run;
+		}
+		if(run == end)
+			continue;
+
+		// Compressed stint
+		end= MIN(ii+RLE_RUN_MAX, srcS);
+		run= RleRunLength(src, ii, end);
+		if(!final && ii+run == srcS && run < RLE_RUN_MAX)
+			break;
+		if(dstL + 2 > dstEnd)
+			return NULL;
+		dstL[0]= 0x80 | (run-RLE_RUN_MIN);
+		dstL[1]= src[ii];
+		dstL += 2;
+		ii += run;
+	}
+
+	*pos= ii;
+	return dstL;
+}
+
+/* RleFindRun() ***********************
+   Position of the first RLE_RUN_MIN equal bytes in src[ii..end>, or
+   \a end if there aren't any. Looks at 16 positions at a time where 
+   it can.
+*/
+INLINE uint RleFindRun(const BYTE *src, uint ii, uint end)
+{
+#ifdef __SSE2__
+	for( ; ii+2+16 <= end; ii += 16)
+	{
+		__m128i v0= _mm_loadu_si128((const __m128i*)&src[ii]);
+		__m128i v1= _mm_loadu_si128((const __m128i*)&src[ii+1]);
+		__m128i v2= _mm_loadu_si128((const __m128i*)&src[ii+2]);
+		uint mask= _mm_movemask_epi8(_mm_and_si128(
+			_mm_cmpeq_epi8(v0, v1), _mm_cmpeq_epi8(v1, v2)));
+		if(mask)
+			return ii + __builtin_ctz(mask);
+	}
+#endif
+	for( ; ii+2 < end; ii++)
+		if(src[ii] == src[ii+1] && src[ii] == src[ii+2])
+			return ii;
+
+	return end;
+}
+
+/* RleRunLength() *********************
+   Number of bytes in src[ii..end> equal to src[ii].
+*/
+INLINE uint RleRunLength(const BYTE *src, uint ii, uint end)
+{
+	uint start= ii;
+
+#ifdef __SSE2__
+	__m128i key= _mm_set1_epi8((char)src[ii]);
+	for( ; ii+16 <= end; ii += 16)
+	{
+		uint mask= 0xFFFF & ~_mm_movemask_epi8(_mm_cmpeq_epi8(key, 
+			_mm_loadu_si128((const __m128i*)&src[ii])));
+		if(mask)
+			return ii + __builtin_ctz(mask) - start;
+	}
+#endif
+	while(ii < end && src[ii] == src[start])
+		ii++;
+
+	return ii-start;
+}
+
+/* RleOptimal() ***********************
+   Smallest possible encoding of src, by dynamic programming over the
+   prefixes. With best[ii] the cost of src[0..ii>, the last stint of
+   the prefix is either raw, costing best[jj]+ii-jj+1 for jj within 
+   RLE_NON_MAX of ii, or a run of ii-jj equal bytes costing 
+   best[jj]+2. Both minima are over windows that only ever move 
+   forward, so monotone queues give them in constant time.
+     Since best[srcS] is the exact output size, the stints can then
+   be written from the back while walking the choices back. Returns 
+   the output size or a negative ECprsError.
+*/
+int RleOptimal(BYTE *dst, uint dstS, const BYTE *src, uint srcS)
+{
+	uint ii, jj, rr, size;
+	uint nonQ[RLE_NON_MAX], runQ[RLE_RUN_MAX];	// Ring buffers
+	uint nonH= 0, nonT= 0, runH= 0, runT= 0;
+
+	// best[ii] and the length of the last stint; runs are negative.
+	int *best= (int*)malloc((srcS+1)*sizeof(int));
+	short *last= (short*)malloc((srcS+1)*sizeof(short));
+	if(best == NULL || last == NULL)
+	{
+		free(best);
+		free(last);
+		return CPRS_ERR_MEM;
+	}
+
+	best[0]= 0;
+	for(ii=1, rr=0; ii<=srcS; ii++)
+	{
+		// Equal bytes ending at ii.
+		rr= (ii>1 && src[ii-1] == src[ii-2]) ? rr+1 : 1;
+
+		// Raw: keep jj in [ii-RLE_NON_MAX, ii-1], best[jj]-jj rising.
+		if(nonT > nonH && nonQ[nonH % RLE_NON_MAX] + RLE_NON_MAX < ii)
+			nonH++;
+		jj= ii-1;
+		while(nonT > nonH && 
+			best[nonQ[(nonT-1)%RLE_NON_MAX]] - (int)nonQ[(nonT-1)%RLE_NON_MAX] 
+				>= best[jj] - (int)jj)
+			nonT--;
+		nonQ[nonT++ % RLE_NON_MAX]= jj;
+		jj= nonQ[nonH % RLE_NON_MAX];
+		best[ii]= best[jj] + ii-jj + 1;
+		last[ii]= ii-jj;
+
+		// Run: jj in [ii-MIN(rr, RLE_RUN_MAX), ii-RLE_RUN_MIN], best[jj] rising.
+		if(ii >= RLE_RUN_MIN)
+		{
+			jj= ii-RLE_RUN_MIN;
+			while(runT > runH && best[runQ[(runT-1)%RLE_RUN_MAX]] >= best[jj])
+				runT--;
+			runQ[runT++ % RLE_RUN_MAX]= jj;
+		}
+		while(runT > runH && runQ[runH % RLE_RUN_MAX] + MIN(rr, RLE_RUN_MAX) < ii)
+			runH++;
+		if(runT > runH)
+		{
+			jj= runQ[runH % RLE_RUN_MAX];
+			if(best[jj] + 2 < best[ii])
+			{
+				best[ii]= best[jj] + 2;
+				last[ii]= -(int)(ii-jj);
+			}
+		}
+	}
+
+	size= best[srcS];
+	if(size > dstS)
+	{
+		free(best);
+		free(last);
+		return CPRS_ERR_SPACE;
+	}
+
+	// Write the stints back to front.
+	for(ii=srcS, dst += size; ii>0; )
+	{
+		if(last[ii] < 0)
+		{
+			rr= -last[ii];
+			ii -= rr;
+			dst -= 2;
+			dst[0]= 0x80 | (rr-RLE_RUN_MIN);
+			dst[1]= src[ii];
+		}
+		else
+		{
+			rr= last[ii];
+			ii -= rr;
+			dst -= rr+1;
+			dst[0]= rr-1;
+			memcpy(&dst[1], &src[ii], rr);
+		}
+	}
+
+	free(best);
+	free(last);
+
+	return size;
 }
 
 // EOF
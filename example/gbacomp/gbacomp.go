@@ -31,11 +31,13 @@ import (
 )
 
 var (
-	method  = flag.String("method", "", "Compression method: rle,lz77,huff8,huff4. When not set, does decompression instead.")
+	method  = flag.String("method", "", "Compression method: rle,lz77,lz77wram,huff,huff8,huff4,huff2,huff1,diff8,diff16. When not set, does decompression instead.")
+	level   = flag.Int("level", gbacomp.DefaultCompression, "Compression level: 0 (default), 1 (fastest) to 10 (best)")
+	threads = flag.Int("threads", 1, "Threads to compress large LZ77 inputs on; 0 for one per CPU")
 	inname  = flag.String("i", "", "input filename")
 	outname = flag.String("o", "", "output filename")
 
-	gbacompMethod = map[string]gbacomp.Method{"lz77": gbacomp.LZ77, "rle": gbacomp.RLE, "huff4": gbacomp.Huffman4, "huff8": gbacomp.Huffman8}
+	gbacompMethod = map[string]gbacomp.Method{"lz77": gbacomp.LZ77, "lz77wram": gbacomp.LZ77Wram, "rle": gbacomp.RLE, "huff": gbacomp.HuffmanAuto, "huff1": gbacomp.Huffman1, "huff2": gbacomp.Huffman2, "huff4": gbacomp.Huffman4, "huff8": gbacomp.Huffman8, "diff8": gbacomp.Diff8, "diff16": gbacomp.Diff16}
 )
 
 func chk(err error) {
@@ -68,7 +70,11 @@ func main() {
 		chk(err)
 	} else {
 		if m, ok := gbacompMethod[*method]; ok {
-			outData, err = gbacomp.Compress(m, inData)
+			if *threads == 1 {
+				outData, err = gbacomp.CompressLevel(m, *level, inData)
+			} else {
+				outData, err = gbacomp.CompressParallel(m, *level, inData, *threads)
+			}
 			chk(err)
 		} else {
 			log.Fatal("unknown method", *method)
@@ -25,18 +25,29 @@
 // See http://nocash.emubase.de/gbatek.htm#biosdecompressionfunctions for details.
 package gbacomp
 
-// TODO(utkan); LZ77 VRAM-safe
-// TODO(utkan); Diff8/Diff16 filters
+/*
+#cgo LDFLAGS: -lpthread
+#include "cprs.h"
+#include <string.h>
+
+// Go boxes pointers to incomplete types to check them when calling C,
+// which costs an allocation; void pointers it can check as they are.
+static int lz77_buf(void *ctx, BYTE *dst, uint dstS, const BYTE *src, uint srcS, int level, int vram)
+{	return lz77gba_compress_buf(ctx, dst, dstS, src, srcS, level, vram);	}
 
-//#include "cprs.h"
-//#include <string.h>
+static int huffman_buf(void *ctx, BYTE *dst, uint dstS, const BYTE *src, uint srcS, int data_size)
+{	return huffman_encode_buf(ctx, dst, dstS, src, srcS, data_size);	}
+*/
 import "C"
 
 import (
 	"bytes"
 	"errors"
 	"io"
-	"io/ioutil"
+	"runtime"
+	"sort"
+	"sync"
+	"sync/atomic"
 	"unsafe"
 )
 
@@ -47,22 +58,66 @@ const (
 	LZ77     Method = 0x10 // VRAM-safe LZSS
 	Huffman4 Method = 0x24
 	Huffman8 Method = 0x28
+
+	// Huffman on 1 and 2 bit symbols, for bit planes and collision
+	// maps. Symbols are taken from the low bits of each byte up.
+	Huffman1 Method = 0x21
+	Huffman2 Method = 0x22
+
+	// Huffman4 or Huffman8, whichever comes out smaller. Only the
+	// winner is encoded; the output is tagged as that one.
+	HuffmanAuto Method = 0x20
+
+	// Not compression, but filters that store each byte or halfword
+	// as the difference with the one before. Smooth data, such as
+	// palettes and sound, compresses better with LZ77 or RLE after.
+	// Diff16 needs an even number of bytes.
+	Diff8  Method = 0x81
+	Diff16 Method = 0x82
+
+	// LZSS for LZ77UnCompWram only: allows matches at distance 1,
+	// which helps on runs. The output is tagged as plain LZ77.
+	LZ77Wram Method = 0x110
 )
 
 const (
 	MaxSize = 0x00ffffff
+
+	// Most stages DecompressChain unwraps.
+	MaxChain = C.CPRS_CHAIN_MAX
+)
+
+// Compression levels. LZ77 has the full range; RLE has the classic
+// encoder and, at BestCompression, an optimal one. Huffman ignores the
+// level.
+const (
+	DefaultCompression = 0 // The classic encoder.
+	BestSpeed          = 1
+	BestCompression    = 10 // Optimal parse; use for final builds.
 )
 
 func (m Method) String() string {
 	switch m {
+	case Huffman1:
+		return "Huffman1"
+	case Huffman2:
+		return "Huffman2"
 	case Huffman4:
 		return "Huffman4"
 	case Huffman8:
 		return "Huffman8"
+	case HuffmanAuto:
+		return "HuffmanAuto"
 	case RLE:
 		return "RLE"
 	case LZ77:
 		return "LZ77"
+	case LZ77Wram:
+		return "LZ77Wram"
+	case Diff8:
+		return "Diff8"
+	case Diff16:
+		return "Diff16"
 	}
 	return ""
 }
@@ -71,47 +126,111 @@ var (
 	UnexpectedError = errors.New("Unexpected error")
 	UnknownMethod   = errors.New("Unexpected method")
 	InputTooLarge   = errors.New("Input data is too large") // Uncompressed data length wouldn't fit in header if any larger.
+	SizeMismatch    = errors.New("Written data does not match the declared size")
+	CorruptData     = errors.New("Compressed data is corrupt")
+	OddSize         = errors.New("Diff16 input has an odd number of bytes")
 )
 
-func exec(compress bool, method Method, data []byte) ([]byte, error) {
-	if compress && len(data) > MaxSize {
+// Compresses data in C, which allocates the output. s has the encoders
+// to use; nil for pooled ones.
+func exec(method Method, level, threads int, data []byte, s *scratch) ([]byte, error) {
+	if len(data) > MaxSize {
 		return []byte{}, InputTooLarge
 	}
+	if method == Diff16 && len(data)%2 != 0 {
+		return []byte{}, OddSize
+	}
+	if s == nil {
+		s = getScratch()
+		defer scratches.Put(s)
+	}
 
-	src := new(C.RECORD)
-	src.width = 1
-	src.height = C.int(len(data))
-	src.data = (*C.uchar)(unsafe.Pointer(&data[0]))
+	var pinner runtime.Pinner
+	defer pinner.Unpin()
+	src := record(&pinner, data)
 	dst := new(C.RECORD)
 
 	switch method {
-	case Huffman4:
-		if compress {
-			C.huffman_encode(dst, src, 4)
-		} else {
-			C.huffman_decode(dst, src)
-		}
-	case Huffman8:
-		if compress {
-			C.huffman_encode(dst, src, 8)
-		} else {
-			C.huffman_decode(dst, src)
-		}
+	case HuffmanAuto, Huffman1, Huffman2, Huffman4, Huffman8:
+		C.huffman_encode_ctx(s.huffman(), dst, src, C.int(method&0xF))
 	case RLE:
-		if compress {
-			C.rle8gba_compress(dst, src)
-		} else {
-			C.rle8gba_decompress(dst, src)
+		C.rle8gba_compress(dst, src, C.int(level))
+	case Diff8:
+		C.diffgba_compress(dst, src, 8)
+	case Diff16:
+		C.diffgba_compress(dst, src, 16)
+	case LZ77, LZ77Wram:
+		vram := C.int(0)
+		if method == LZ77 {
+			vram = 1
 		}
-	case LZ77:
-		if compress {
-			C.lz77gba_compress(dst, src)
+		if threads > 0 {
+			C.lz77gba_compress_mt(dst, src, C.int(level), vram, C.int(threads))
 		} else {
-			C.lz77gba_decompress(dst, src)
+			C.lz77gba_compress_ctx(s.lz77(), dst, src, C.int(level), vram)
 		}
 	default:
 		return []byte{}, UnknownMethod
 	}
+	return result(dst)
+}
+
+// The encoders' working memory, kept around so compressing doesn't
+// keep allocating it: in a pool, or by a batch worker from one job to
+// the next. Encoders are made when first needed, and if C is out of
+// memory, left nil for the encode to make its own and fail properly.
+type scratch struct {
+	lz  *C.LZ77CTX
+	huf *C.HUFCTX
+}
+
+func (s *scratch) lz77() *C.LZ77CTX {
+	if s.lz == nil {
+		s.lz = C.lz77gba_create()
+	}
+	return s.lz
+}
+
+func (s *scratch) huffman() *C.HUFCTX {
+	if s.huf == nil {
+		s.huf = C.huffman_create()
+	}
+	return s.huf
+}
+
+func (s *scratch) free() {
+	C.lz77gba_destroy(s.lz)
+	C.huffman_destroy(s.huf)
+	s.lz, s.huf = nil, nil
+}
+
+var scratches sync.Pool
+
+// Returns pooled encoders. C frees them once the pool lets go of them.
+func getScratch() *scratch {
+	if s, ok := scratches.Get().(*scratch); ok {
+		return s
+	}
+	s := new(scratch)
+	runtime.SetFinalizer(s, (*scratch).free)
+	return s
+}
+
+// Wraps data in a record for C. data is Go memory, which cgo only
+// lets us pass along if it's pinned; p has to be unpinned once C is
+// done with it.
+func record(p *runtime.Pinner, data []byte) *C.RECORD {
+	p.Pin(&data[0])
+
+	src := new(C.RECORD)
+	src.width = 1
+	src.height = C.int(len(data))
+	src.data = (*C.uchar)(unsafe.Pointer(&data[0]))
+	return src
+}
+
+// Copies what C left in dst into Go memory, and frees it.
+func result(dst *C.RECORD) ([]byte, error) {
 	defer C.free(unsafe.Pointer(dst.data))
 
 	n := dst.width * dst.height
@@ -126,46 +245,623 @@ func exec(compress bool, method Method, data []byte) ([]byte, error) {
 }
 
 func Decompress(data []byte) (decompressed []byte, err error) {
-	return exec(false, Method(data[0]), data)
+	return DecompressAppend(nil, data)
 }
 
 // Compresses data using a given method.
 func Compress(method Method, data []byte) (compressed []byte, err error) {
-	return exec(true, method, data)
+	return exec(method, DefaultCompression, 0, data, nil)
+}
+
+// Compresses data using a given method and level, which trades speed
+// for size: from BestSpeed to BestCompression, or DefaultCompression.
+func CompressLevel(method Method, level int, data []byte) (compressed []byte, err error) {
+	return exec(method, level, 0, data, nil)
+}
+
+// Like CompressLevel, but large inputs are compressed in parallel, on
+// up to threads threads (runtime.NumCPU() if threads <= 0). Only LZ77
+// makes use of this. The output does not depend on the number of
+// threads, but is slightly bigger than what CompressLevel gives.
+func CompressParallel(method Method, level int, data []byte, threads int) (compressed []byte, err error) {
+	if threads <= 0 {
+		threads = runtime.NumCPU()
+	}
+	return exec(method, level, threads, data, nil)
+}
+
+// Appends data compressed with method m to dst, and returns the
+// extended slice. The output goes straight into dst, which only grows
+// if it hasn't room for the worst case, so passing the last result
+// back in as dst[:0] compresses without allocating anything.
+func CompressAppend(dst []byte, m Method, src []byte) ([]byte, error) {
+	if len(src) > MaxSize {
+		return dst, InputTooLarge
+	}
+	if m == Diff16 && len(src)%2 != 0 {
+		return dst, OddSize
+	}
+	bound := int(C.cprs_compress_bound(C.uint(len(src)), C.u8(m&0xFF)))
+	if bound == 0 || m.String() == "" {
+		return dst, UnknownMethod
+	}
+	dst = grow(dst, bound)
+	s := getScratch()
+	defer scratches.Put(s)
+
+	out, outS := tail(dst, bound)
+	in, inS := cbuf(src)
+	var n C.int
+	switch m {
+	case LZ77, LZ77Wram:
+		vram := C.int(0)
+		if m == LZ77 {
+			vram = 1
+		}
+		n = C.lz77_buf(unsafe.Pointer(s.lz77()), out, outS, in, inS, DefaultCompression, vram)
+	case HuffmanAuto, Huffman1, Huffman2, Huffman4, Huffman8:
+		n = C.huffman_buf(unsafe.Pointer(s.huffman()), out, outS, in, inS, C.int(m&0xF))
+	default:
+		n = C.cprs_compress_buf(out, outS, in, inS, C.int(m), DefaultCompression)
+	}
+	if n < 0 {
+		return dst, cprsError(n)
+	}
+	return dst[:len(dst)+int(n)], nil
+}
+
+// Appends the decompressed src to dst, and returns the extended slice.
+// dst only grows if it hasn't room for the size in the header; as for
+// CompressAppend, reusing it saves allocating anything.
+func DecompressAppend(dst, src []byte) ([]byte, error) {
+	if len(src) < 4 {
+		return dst, CorruptData
+	}
+	switch Method(src[0]) {
+	case LZ77, RLE, Huffman1, Huffman2, Huffman4, Huffman8, Diff8, Diff16:
+	default:
+		return dst, UnknownMethod
+	}
+	size := int(C.cprs_decompress_size(cbuf(src)))
+	dst = grow(dst, size)
+
+	out, outS := tail(dst, size)
+	in, inS := cbuf(src)
+	n := C.cprs_decompress_buf(out, outS, in, inS)
+	if n < 0 {
+		return dst, cprsError(n)
+	}
+	return dst[:len(dst)+int(n)], nil
+}
+
+// Returns b with room for n more bytes after its length.
+func grow(b []byte, n int) []byte {
+	if cap(b)-len(b) >= n {
+		return b
+	}
+	return append(b, make([]byte, n)...)[:len(b)]
+}
+
+// Somewhere for C to write nothing to.
+var nowhere [1]byte
+
+// Where C can write the n bytes after the length of b, which has room
+// for them. Go memory without pointers in it can be handed to C for the
+// length of a call as it is.
+func tail(b []byte, n int) (*C.BYTE, C.uint) {
+	if n == 0 {
+		return (*C.BYTE)(unsafe.Pointer(&nowhere[0])), 0
+	}
+	return (*C.BYTE)(unsafe.Pointer(&b[len(b):cap(b)][0])), C.uint(n)
+}
+
+// b for C to read.
+func cbuf(b []byte) (*C.BYTE, C.uint) {
+	if len(b) == 0 {
+		return nil, 0
+	}
+	return (*C.BYTE)(unsafe.Pointer(&b[0])), C.uint(len(b))
+}
+
+// The error for a negative ECprsError.
+func cprsError(n C.int) error {
+	if n == C.CPRS_ERR_DATA {
+		return CorruptData
+	}
+	return UnexpectedError
+}
+
+// Compresses data with each of methods in turn, e.g. RLE then
+// Huffman8, for assets the game decodes in several passes. All stages
+// run in one go in C, between two working buffers whatever the length
+// of the chain.
+func CompressChain(methods []Method, data []byte) (compressed []byte, err error) {
+	if len(methods) == 0 {
+		return []byte{}, UnknownMethod
+	}
+	if len(data) > MaxSize {
+		return []byte{}, InputTooLarge
+	}
+	if len(data) == 0 {
+		return []byte{}, UnexpectedError
+	}
+	if methods[0] == Diff16 && len(data)%2 != 0 {
+		return []byte{}, OddSize
+	}
+	stages := make([]C.int, len(methods))
+	for i, m := range methods {
+		if m.String() == "" {
+			return []byte{}, UnknownMethod
+		}
+		stages[i] = C.int(m)
+	}
+
+	var pinner runtime.Pinner
+	defer pinner.Unpin()
+	src := record(&pinner, data)
+	dst := new(C.RECORD)
+	C.cprs_compress_chain(dst, src, &stages[0], C.int(len(stages)), DefaultCompression)
+	return result(dst)
+}
+
+// One piece of data for CompressBatch.
+type Job struct {
+	Method Method
+	Level  int
+	Data   []byte
+}
+
+// What came of one job in a batch.
+type Result struct {
+	Data []byte
+	Err  error
+}
+
+// Compresses the data of each job, on up to workers threads, or
+// GOMAXPROCS if workers isn't positive. The biggest jobs go first, so
+// no big one is left to hold things up at the end, and each worker
+// keeps its encoders from one job to the next. The results are in the
+// same order as the jobs.
+func CompressBatch(jobs []Job, workers int) []Result {
+	results := make([]Result, len(jobs))
+	batch(len(jobs), workers, func(i int) int { return len(jobs[i].Data) }, func(s *scratch, i int) {
+		j := jobs[i]
+		if len(j.Data) == 0 {
+			results[i].Data, results[i].Err = []byte{}, UnexpectedError
+			return
+		}
+		results[i].Data, results[i].Err = exec(j.Method, j.Level, 0, j.Data, s)
+	})
+	return results
+}
+
+// Decompresses each of data, the same way CompressBatch compresses.
+func DecompressBatch(data [][]byte, workers int) []Result {
+	results := make([]Result, len(data))
+	batch(len(data), workers, func(i int) int { return len(data[i]) }, func(s *scratch, i int) {
+		if len(data[i]) < 4 {
+			results[i].Data, results[i].Err = []byte{}, CorruptData
+			return
+		}
+		results[i].Data, results[i].Err = Decompress(data[i])
+	})
+	return results
+}
+
+// Calls do for 0 to n-1, biggest first by size, on up to workers
+// goroutines locked to their threads. Each takes the next one as it
+// gets done, so small ones fill in around the big ones.
+func batch(n, workers int, size func(i int) int, do func(s *scratch, i int)) {
+	if workers <= 0 {
+		workers = runtime.GOMAXPROCS(0)
+	}
+	if workers > n {
+		workers = n
+	}
+	order := make([]int, n)
+	for i := range order {
+		order[i] = i
+	}
+	sort.SliceStable(order, func(a, b int) bool { return size(order[a]) > size(order[b]) })
+
+	var next int64 = -1
+	var wg sync.WaitGroup
+	for w := 0; w < workers; w++ {
+		wg.Add(1)
+		go func() {
+			defer wg.Done()
+			runtime.LockOSThread()
+			defer runtime.UnlockOSThread()
+
+			var s scratch
+			defer s.free()
+			for {
+				k := atomic.AddInt64(&next, 1)
+				if k >= int64(n) {
+					return
+				}
+				do(&s, order[k])
+			}
+		}()
+	}
+	wg.Wait()
+}
+
+// Compresses data with each of methods at once, or with RLE, LZ77,
+// Huffman4 and Huffman8 if none are given, and returns the smallest
+// output and the method that made it. Ties go to the method listed
+// first. A method gives up as soon as its output is bigger than one
+// that's done, so this takes about as long as the slowest method that
+// can still win. sizes has what each method came to, or -1 for those
+// that gave up.
+func CompressBest(data []byte, methods ...Method) (compressed []byte, method Method, sizes map[Method]int, err error) {
+	if len(methods) == 0 {
+		methods = []Method{RLE, LZ77, Huffman4, Huffman8}
+	}
+	if len(data) == 0 {
+		return []byte{}, 0, nil, UnexpectedError
+	}
+	if len(data) > MaxSize {
+		return []byte{}, 0, nil, InputTooLarge
+	}
+	tags := make([]C.int, len(methods))
+	for i, m := range methods {
+		if m.String() == "" {
+			return []byte{}, 0, nil, UnknownMethod
+		}
+		if m == Diff16 && len(data)%2 != 0 {
+			return []byte{}, 0, nil, OddSize
+		}
+		tags[i] = C.int(m)
+	}
+
+	var pinner runtime.Pinner
+	defer pinner.Unpin()
+	src := record(&pinner, data)
+	dst := new(C.RECORD)
+	csizes := make([]C.int, len(methods))
+	C.cprs_compress_best(dst, src, &tags[0], C.int(len(tags)), DefaultCompression, &csizes[0])
+
+	sizes = make(map[Method]int, len(methods))
+	best := -1
+	for i, m := range methods {
+		sizes[m] = -1
+		if n := int(csizes[i]); n >= 0 {
+			sizes[m] = n
+			if best < 0 || n < int(csizes[best]) {
+				best = i
+			}
+		}
+	}
+	if best >= 0 {
+		method = methods[best]
+	}
+	compressed, err = result(dst)
+	return compressed, method, sizes, err
+}
+
+// Like Decompress, but as long as the output is compressed data
+// itself, decompresses that too, undoing CompressChain in one go.
+// Plain data that happens to look like a GBA stream and decodes
+// without error gets unwrapped as well, so use Decompress when the
+// number of stages is known to be one. As a stream can decode to
+// itself, no more than MaxChain stages are unwrapped; data nested
+// deeper comes back still compressed.
+func DecompressChain(data []byte) (decompressed []byte, err error) {
+	if len(data) < 4 {
+		return []byte{}, CorruptData
+	}
+	var pinner runtime.Pinner
+	defer pinner.Unpin()
+	src := record(&pinner, data)
+	dst := new(C.RECORD)
+	C.cprs_decompress_chain(dst, src)
+	return result(dst)
 }
 
+// Returns a reader that decompresses what it reads from r as it goes,
+// using a fixed amount of memory. The header is read right away, to
+// find out the method.
 func NewDecompressor(r io.Reader) (io.Reader, error) {
-	read, err := ioutil.ReadAll(r)
-	if err != nil {
+	d := &Decompressor{r: r, in: make([]byte, 32*1024)}
+	if _, err := io.ReadFull(r, d.in[:4]); err != nil {
 		return nil, err
 	}
-	decompressed, err := Decompress(read)
-	if err != nil {
-		return nil, err
+	d.inW = 4
+
+	switch Method(d.in[0]) {
+	case LZ77:
+		d.lz = C.lz77gba_dstream_init()
+	case RLE:
+		d.rle = C.rle8gba_dstream_init()
+	case Huffman1, Huffman2, Huffman4, Huffman8:
+		d.huf = C.huffman_dstream_init()
+	default:
+		return nil, UnknownMethod
+	}
+	if d.lz == nil && d.rle == nil && d.huf == nil {
+		return nil, UnexpectedError
 	}
-	return bytes.NewReader(decompressed), nil
+	runtime.SetFinalizer(d, (*Decompressor).free)
+	return d, nil
+}
+
+type Decompressor struct {
+	r        io.Reader
+	in       []byte
+	inR, inW int
+	err      error
+	end      bool // r is at EOF
+
+	lz  *C.LZ77DSTREAM
+	rle *C.RLEDSTREAM
+	huf *C.HUFDSTREAM
+}
+
+func (d *Decompressor) free() {
+	C.lz77gba_dstream_destroy(d.lz)
+	C.rle8gba_dstream_destroy(d.rle)
+	C.huffman_dstream_destroy(d.huf)
+	d.lz, d.rle, d.huf = nil, nil, nil
 }
 
+// Stops the stream with err; the decoder isn't needed any more.
+func (d *Decompressor) fail(err error) {
+	d.err = err
+	d.free()
+}
+
+// Decodes from what's in d.in into p.
+func (d *Decompressor) decode(p []byte) (n, left int) {
+	var used C.uint
+	var src *C.BYTE
+	dst, dstS := (*C.BYTE)(unsafe.Pointer(&p[0])), C.uint(len(p))
+	srcS := C.uint(d.inW - d.inR)
+	if srcS > 0 {
+		src = (*C.BYTE)(unsafe.Pointer(&d.in[d.inR]))
+	}
+
+	switch {
+	case d.lz != nil:
+		n = int(C.lz77gba_dstream_decode(d.lz, dst, dstS, src, srcS, &used))
+		left = int(C.lz77gba_dstream_left(d.lz))
+	case d.rle != nil:
+		n = int(C.rle8gba_dstream_decode(d.rle, dst, dstS, src, srcS, &used))
+		left = int(C.rle8gba_dstream_left(d.rle))
+	default:
+		n = int(C.huffman_dstream_decode(d.huf, dst, dstS, src, srcS, &used))
+		left = int(C.huffman_dstream_left(d.huf))
+	}
+	if n >= 0 {
+		d.inR += int(used)
+	}
+	return
+}
+
+func (d *Decompressor) Read(p []byte) (n int, err error) {
+	for n == 0 && len(p) > 0 {
+		if d.err != nil {
+			return 0, d.err
+		}
+
+		// Decoders may hold on to some input, so there can be
+		// output even with nothing new coming in.
+		var left int
+		inR := d.inR
+		n, left = d.decode(p)
+		if n < 0 {
+			d.fail(CorruptData)
+			return 0, d.err
+		}
+		if left == 0 {
+			d.fail(io.EOF)
+		}
+		if n > 0 || d.inR > inR || d.err != nil {
+			continue
+		}
+
+		m, err := d.r.Read(d.in)
+		d.inR, d.inW = 0, m
+		if m == 0 && err == io.EOF && d.huf != nil && !d.end {
+			// One more go, for a last word cut short.
+			C.huffman_dstream_end(d.huf)
+			d.end = true
+			continue
+		}
+		if m == 0 {
+			if err == io.EOF {
+				err = io.ErrUnexpectedEOF
+			}
+			if err != nil {
+				d.fail(err)
+			}
+		}
+	}
+	return n, nil
+}
+
+// Returns a writer that compresses with method m what's written to
+// it, and passes the result on to w. LZ77, LZ77Wram and RLE compress
+// as the data comes in, using a fixed amount of memory; as the size
+// goes in the header up front, that takes w to be an io.WriteSeeker,
+// so the header can be patched on Close. Otherwise, or for Huffman,
+// all data is held until Close. For LZ77 the output is that of
+// CompressParallel, not Compress.
 func NewCompressor(w io.Writer, m Method) io.WriteCloser {
-	return &Compressor{bytes.NewBuffer([]byte{}), m, w}
+	c := &Compressor{w: w, m: m, size: -1}
+	if ws, ok := w.(io.WriteSeeker); ok {
+		if start, err := ws.Seek(0, io.SeekCurrent); err == nil {
+			c.start = start
+			c.open(C.CPRS_SIZE_UNKNOWN)
+		}
+	}
+	if c.lz == nil && c.rle == nil {
+		c.buf = new(bytes.Buffer)
+	}
+	return c
+}
+
+// Like NewCompressor, but with the total size known up front, which
+// lets LZ77, LZ77Wram and RLE stream to any writer. Writing more or
+// less than size bytes is an error.
+func NewSizedCompressor(w io.Writer, m Method, size int) io.WriteCloser {
+	c := &Compressor{w: w, m: m, size: size}
+	if size < 0 || size > MaxSize {
+		c.err = InputTooLarge
+	} else if c.open(C.uint(size)); c.lz == nil && c.rle == nil {
+		c.buf = new(bytes.Buffer)
+	}
+	return c
 }
 
 type Compressor struct {
-	*bytes.Buffer
-	m Method
-	w io.Writer
+	w     io.Writer
+	m     Method
+	size  int   // Declared size, or -1
+	n     int   // Bytes written so far
+	start int64 // Where the header goes, if it needs patching
+	err   error
+
+	// Either a stream, or everything in buf.
+	lz  *C.LZ77STREAM
+	rle *C.RLESTREAM
+	buf *bytes.Buffer
+	out []byte
 }
 
-// The data will be compressed & flushed during Close.
+func (c *Compressor) open(size C.uint) {
+	switch c.m {
+	case LZ77, LZ77Wram:
+		vram := C.int(0)
+		if c.m == LZ77 {
+			vram = 1
+		}
+		c.lz = C.lz77gba_stream_init(size, DefaultCompression, vram)
+	case RLE:
+		c.rle = C.rle8gba_stream_init(size)
+	}
+	if c.lz != nil || c.rle != nil {
+		c.out = make([]byte, 32*1024)
+	}
+}
+
+func (c *Compressor) feed(p []byte) int {
+	src, n := (*C.BYTE)(unsafe.Pointer(&p[0])), C.uint(len(p))
+	if c.lz != nil {
+		return int(C.lz77gba_stream_feed(c.lz, src, n))
+	}
+	return int(C.rle8gba_stream_feed(c.rle, src, n))
+}
+
+func (c *Compressor) finish() int {
+	if c.lz != nil {
+		return int(C.lz77gba_stream_finish(c.lz))
+	}
+	return int(C.rle8gba_stream_finish(c.rle))
+}
+
+// Passes on all output that's ready.
+func (c *Compressor) flush() error {
+	dst, dstS := (*C.BYTE)(unsafe.Pointer(&c.out[0])), C.uint(len(c.out))
+	for {
+		var n C.int
+		if c.lz != nil {
+			n = C.lz77gba_stream_read(c.lz, dst, dstS)
+		} else {
+			n = C.rle8gba_stream_read(c.rle, dst, dstS)
+		}
+		if n <= 0 {
+			return nil
+		}
+		if _, err := c.w.Write(c.out[:n]); err != nil {
+			return err
+		}
+	}
+}
+
+func (c *Compressor) Write(p []byte) (n int, err error) {
+	if c.err != nil {
+		return 0, c.err
+	}
+	if c.buf != nil {
+		return c.buf.Write(p)
+	}
+
+	for n < len(p) {
+		k := c.feed(p[n:])
+		if k < 0 {
+			c.err = InputTooLarge
+			if c.size >= 0 {
+				c.err = SizeMismatch
+			}
+			return n, c.err
+		}
+		n += k
+		c.n += k
+		if c.err = c.flush(); c.err != nil {
+			return n, c.err
+		}
+	}
+	return n, nil
+}
+
+// Writes out what's left. Unless streaming, this is where the data
+// gets compressed.
 func (c *Compressor) Close() error {
-	compressed, err := Compress(c.m, []byte(c.String()))
-	if err != nil {
+	if c.buf != nil {
+		if c.err != nil {
+			return c.err
+		}
+		if c.size >= 0 && c.buf.Len() != c.size {
+			return SizeMismatch
+		}
+		compressed, err := Compress(c.m, c.buf.Bytes())
+		if err != nil {
+			return err
+		}
+		_, err = c.w.Write(compressed)
 		return err
 	}
-	_, err = c.w.Write(compressed)
-	if err != nil {
+
+	defer func() {
+		C.lz77gba_stream_destroy(c.lz)
+		C.rle8gba_stream_destroy(c.rle)
+		c.lz, c.rle = nil, nil
+	}()
+	if c.lz == nil && c.rle == nil {
+		return c.err
+	}
+	if c.err != nil {
+		return c.err
+	}
+
+	if err := c.flush(); err != nil {
+		return err
+	}
+	if c.finish() < 0 {
+		return SizeMismatch
+	}
+	if err := c.flush(); err != nil {
 		return err
 	}
 
+	if c.size < 0 {
+		// Patch the header
+		ws := c.w.(io.WriteSeeker)
+		end, err := ws.Seek(0, io.SeekCurrent)
+		if err != nil {
+			return err
+		}
+		if _, err = ws.Seek(c.start, io.SeekStart); err != nil {
+			return err
+		}
+		header := uint32(c.m&0xff) | uint32(c.n)<<8
+		_, err = ws.Write([]byte{byte(header), byte(header >> 8), byte(header >> 16), byte(header >> 24)})
+		if err != nil {
+			return err
+		}
+		_, err = ws.Seek(end, io.SeekStart)
+		return err
+	}
 	return nil
 }
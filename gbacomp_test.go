@@ -23,15 +23,19 @@
 package gbacomp
 
 import (
+	"bytes"
+	"io"
 	"io/ioutil"
 	"os"
+	"sync"
 	"testing"
+	"testing/iotest"
 )
 
 var (
 	testdata  [][]byte
 	testfiles = []string{"testdata/Mark.Twain-Tom.Sawyer.txt", "testdata/e.txt", "testdata/pi.txt"}
-	methods   = []Method{RLE, LZ77, Huffman4, Huffman8}
+	methods   = []Method{RLE, LZ77, Huffman1, Huffman2, Huffman4, Huffman8}
 )
 
 func load(path string) []byte {
@@ -91,3 +95,584 @@ func TestRLE(t *testing.T) {
 		}
 	}
 }
+
+func TestConcurrentLZ77(t *testing.T) {
+	concurrent(t, LZ77)
+}
+
+func TestConcurrentHuffman(t *testing.T) {
+	for _, method := range []Method{Huffman1, Huffman2, Huffman4, Huffman8} {
+		concurrent(t, method)
+	}
+}
+
+// Compresses the test data with method on several goroutines at once,
+// which has to give the same as doing it one at a time.
+func concurrent(t *testing.T, method Method) {
+	want := make([][]byte, len(testdata))
+	for i, data := range testdata {
+		c, err := Compress(method, data)
+		if err != nil {
+			t.Fatal("Compress:", err)
+		}
+		want[i] = c
+	}
+
+	var wg sync.WaitGroup
+	for g := 0; g < 8; g++ {
+		wg.Add(1)
+		go func(g int) {
+			defer wg.Done()
+			for j := range testdata {
+				i := (g + j) % len(testdata)
+				c, err := Compress(method, testdata[i])
+				if err != nil {
+					t.Error("Compress:", err)
+					return
+				}
+				if !bytes.Equal(c, want[i]) {
+					t.Error("Concurrent", method, "compression of", testfiles[i], "differs from the serial one")
+				}
+			}
+		}(g)
+	}
+	wg.Wait()
+}
+
+// Returns the smallest match distance used in an LZ77 stream.
+func lz77MinDistance(c []byte) int {
+	min := 1 << 12
+	n := int(c[1]) | int(c[2])<<8 | int(c[3])<<16
+	for i, done := 4, 0; done < n; {
+		flags := c[i]
+		i++
+		for bit := 7; bit >= 0 && done < n; bit-- {
+			if flags>>uint(bit)&1 == 0 {
+				i++
+				done++
+				continue
+			}
+			if d := (int(c[i])&15)<<8 | int(c[i+1]) + 1; d < min {
+				min = d
+			}
+			done += int(c[i]>>4) + 3
+			i += 2
+		}
+	}
+	return min
+}
+
+func TestLZ77Levels(t *testing.T) {
+	sizes := make([]int, len(testdata))
+	for level := DefaultCompression; level <= BestCompression; level++ {
+		for datai, data := range testdata {
+			c, err := CompressLevel(LZ77, level, data)
+			if err != nil {
+				t.Fatal("Compress:", err)
+			}
+			t.Log("Level", level, testfiles[datai], "compressed size:", len(c))
+			if level == DefaultCompression {
+				sizes[datai] = len(c)
+			} else if level == BestCompression && len(c) > sizes[datai] {
+				t.Error("BestCompression is worse than the default on", testfiles[datai])
+			}
+
+			d, err := Decompress(c)
+			if err != nil {
+				t.Fatal("Decompress:", err)
+			}
+			if !bytes.Equal(data, d) {
+				t.Error("Level", level, "does not round-trip", testfiles[datai])
+			}
+			if dist := lz77MinDistance(c); dist < 2 {
+				t.Error("Level", level, "is not VRAM-safe on", testfiles[datai])
+			}
+		}
+	}
+}
+
+func TestLZ77Wram(t *testing.T) {
+	runs := bytes.Repeat([]byte("aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaab"), 100)
+	for level := DefaultCompression; level <= BestCompression; level++ {
+		for _, data := range append(testdata, runs) {
+			c, err := CompressLevel(LZ77Wram, level, data)
+			if err != nil {
+				t.Fatal("Compress:", err)
+			}
+			d, err := Decompress(c)
+			if err != nil {
+				t.Fatal("Decompress:", err)
+			}
+			if !bytes.Equal(data, d) {
+				t.Error("Level", level, "does not round-trip")
+			}
+		}
+
+		w, _ := CompressLevel(LZ77Wram, level, runs)
+		v, _ := CompressLevel(LZ77, level, runs)
+		if lz77MinDistance(w) != 1 || len(w) > len(v) {
+			t.Error("Level", level, "does not take advantage of distance 1 matches")
+		}
+	}
+}
+
+func TestLZ77Corrupt(t *testing.T) {
+	c, _ := Compress(LZ77, testdata[0])
+	for _, n := range []int{4, len(c) / 2, len(c) - 8} {
+		if _, err := Decompress(c[:n]); err == nil {
+			t.Error("Truncated stream of", n, "bytes decompressed without error")
+		}
+	}
+
+	// A match reaching back before the start of the output.
+	bad := []byte{0x10, 3, 0, 0, 0x80, 0x00, 0x05, 0}
+	if _, err := Decompress(bad); err == nil {
+		t.Error("Out-of-range match decompressed without error")
+	}
+}
+
+func TestHuffmanCorrupt(t *testing.T) {
+	c, _ := Compress(Huffman8, testdata[0])
+	for _, n := range []int{4, 5, len(c) / 2, len(c) - 8} {
+		if _, err := Decompress(c[:n]); err == nil {
+			t.Error("Truncated stream of", n, "bytes decompressed without error")
+		}
+	}
+
+	// Two symbols, A on 0 and B on 1, and a root whose children would
+	// be past the end of the tree.
+	tree := []byte{1, 0xC0, 'A', 'B'}
+	bad := append([]byte{0x28, 4, 0, 0}, tree...)
+	bad[5] |= 0x3F
+	if _, err := Decompress(append(bad, 0, 0, 0, 0)); err == nil {
+		t.Error("Out-of-range tree offset decompressed without error")
+	}
+
+	// A last word cut short reads as if padded with zeroes.
+	short := append(append([]byte{0x28, 4, 0, 0}, tree...), 0)
+	if d, err := Decompress(short); err != nil || string(d) != "AAAA" {
+		t.Error("Short last word decompressed to", d, err)
+	}
+}
+
+func TestLZ77Parallel(t *testing.T) {
+	data := bytes.Join(testdata, nil)
+	for len(data) < 1<<20 {
+		data = append(data, data...)
+	}
+
+	for _, level := range []int{DefaultCompression, BestSpeed, BestCompression} {
+		serial, _ := CompressLevel(LZ77, level, data)
+		var first []byte
+		for _, threads := range []int{1, 2, 4} {
+			c, err := CompressParallel(LZ77, level, data, threads)
+			if err != nil {
+				t.Fatal("CompressParallel:", err)
+			}
+			if first == nil {
+				first = c
+			} else if !bytes.Equal(first, c) {
+				t.Error("Level", level, "output depends on the number of threads")
+			}
+
+			d, err := Decompress(c)
+			if err != nil {
+				t.Fatal("Decompress:", err)
+			}
+			if !bytes.Equal(data, d) {
+				t.Error("Level", level, "does not round-trip on", threads, "threads")
+			}
+		}
+		t.Log("Level", level, "serial:", len(serial), "parallel:", len(first))
+		if len(first) > len(serial)+len(serial)/200 {
+			t.Error("Level", level, "parallel output is much bigger than serial")
+		}
+	}
+}
+
+func TestRLEOptimal(t *testing.T) {
+	// Runs right at the end of a full raw stint are missed by the
+	// greedy encoder.
+	var runs []byte
+	for i := 0; i < 300; i++ {
+		for j := 0; j < 126; j++ {
+			runs = append(runs, byte(j))
+		}
+		runs = append(runs, bytes.Repeat([]byte{0xFF}, 10)...)
+	}
+	for _, data := range append(testdata, runs) {
+		greedy, _ := Compress(RLE, data)
+		c, err := CompressLevel(RLE, BestCompression, data)
+		if err != nil {
+			t.Fatal("Compress:", err)
+		}
+		t.Log("Greedy:", len(greedy), "optimal:", len(c))
+		if len(c) > len(greedy) {
+			t.Error("Optimal RLE is bigger than greedy")
+		}
+
+		d, err := Decompress(c)
+		if err != nil {
+			t.Fatal("Decompress:", err)
+		}
+		if !bytes.Equal(data, d) {
+			t.Error("Optimal RLE does not round-trip")
+		}
+	}
+
+	greedy, _ := Compress(RLE, runs)
+	c, _ := CompressLevel(RLE, BestCompression, runs)
+	if len(c) >= len(greedy) {
+		t.Error("Optimal RLE does not beat greedy on short runs")
+	}
+}
+
+func TestDiff(t *testing.T) {
+	// A 16-bit ramp; it only compresses well once filtered.
+	ramp := make([]byte, 0, 8192)
+	for i := 0; i < 4096; i++ {
+		ramp = append(ramp, byte(i*37), byte(i*37>>8))
+	}
+	for _, method := range []Method{Diff8, Diff16} {
+		for _, data := range append(testdata, ramp, ramp[:17&^1]) {
+			data = data[:len(data)&^1]
+			c, err := Compress(method, data)
+			if err != nil {
+				t.Fatal("Compress:", err)
+			}
+			d, err := Decompress(c)
+			if err != nil {
+				t.Fatal("Decompress:", err)
+			}
+			if !bytes.Equal(data, d) {
+				t.Error(method, "does not round-trip")
+			}
+		}
+	}
+
+	raw, _ := Compress(LZ77, ramp)
+	diff, _ := Compress(Diff16, ramp)
+	filtered, _ := Compress(LZ77, diff)
+	t.Log("LZ77:", len(raw), "Diff16+LZ77:", len(filtered))
+	if len(filtered) >= len(raw)/4 {
+		t.Error("Diff16 does not help LZ77 on a ramp")
+	}
+
+	if _, err := Compress(Diff16, ramp[:3]); err != OddSize {
+		t.Error("Odd Diff16 input gave", err)
+	}
+}
+
+func TestChain(t *testing.T) {
+	chains := [][]Method{{RLE, Huffman8}, {LZ77, Huffman8}, {Diff8, LZ77Wram, Huffman4}, {LZ77}}
+	for _, methods := range chains {
+		for datai, data := range testdata {
+			want := data
+			for _, m := range methods {
+				want, _ = Compress(m, want)
+			}
+			c, err := CompressChain(methods, data)
+			if err != nil {
+				t.Fatal("CompressChain:", err)
+			}
+			if !bytes.Equal(c, want) {
+				t.Error(methods, testfiles[datai], "differs from compressing stage by stage")
+			}
+
+			d, err := DecompressChain(c)
+			if err != nil {
+				t.Fatal("DecompressChain:", err)
+			}
+			if !bytes.Equal(data, d) {
+				t.Error(methods, testfiles[datai], "does not round-trip")
+			}
+		}
+	}
+
+	if _, err := CompressChain([]Method{RLE, 0x42}, testdata[0]); err != UnknownMethod {
+		t.Error("Unknown stage gave", err)
+	}
+	// Past MaxChain stages, what's left comes back still compressed.
+	deep := make([]Method, MaxChain+2)
+	for i := range deep {
+		deep[i] = LZ77
+	}
+	c, err := CompressChain(deep, testdata[1][:1000])
+	if err != nil {
+		t.Fatal("CompressChain:", err)
+	}
+	want, _ := CompressChain(deep[:2], testdata[1][:1000])
+	if d, err := DecompressChain(c); err != nil || !bytes.Equal(d, want) {
+		t.Error("DecompressChain did not stop after", MaxChain, "stages")
+	}
+
+	if _, err := CompressChain([]Method{LZ77}, nil); err == nil {
+		t.Error("CompressChain took empty input")
+	}
+	for _, short := range [][]byte{nil, {0x10}, {0x10, 0, 0}} {
+		if _, err := DecompressChain(short); err != CorruptData {
+			t.Error("DecompressChain of", len(short), "bytes gave", err)
+		}
+	}
+}
+
+func TestHuffmanOneSymbol(t *testing.T) {
+	for _, method := range []Method{Huffman1, Huffman2, Huffman4, Huffman8} {
+		for _, data := range [][]byte{{0x11}, bytes.Repeat([]byte{0xAB}, 1000), bytes.Repeat([]byte{0x77}, 3)} {
+			c, err := Compress(method, data)
+			if err != nil {
+				t.Fatal("Compress:", err)
+			}
+			d, err := Decompress(c)
+			if err != nil {
+				t.Fatal("Decompress:", err)
+			}
+			if !bytes.Equal(data, d) {
+				t.Error(method, "does not round-trip a single symbol")
+			}
+		}
+	}
+}
+
+func TestBatch(t *testing.T) {
+	var jobs []Job
+	for _, method := range append(methods, HuffmanAuto, Diff8) {
+		for _, data := range testdata {
+			for _, n := range []int{len(data), 1000, 17} {
+				jobs = append(jobs, Job{method, BestSpeed, data[:n]})
+			}
+		}
+	}
+	jobs = append(jobs, Job{Method(0x99), 0, testdata[0]})
+
+	for _, workers := range []int{0, 1, 3} {
+		results := CompressBatch(jobs, workers)
+		var packed [][]byte
+		for i, j := range jobs {
+			want, wantErr := CompressLevel(j.Method, j.Level, j.Data)
+			if results[i].Err != wantErr || !bytes.Equal(results[i].Data, want) {
+				t.Fatal("CompressBatch on", workers, "workers differs from CompressLevel for job", i)
+			}
+			if wantErr == nil {
+				packed = append(packed, want)
+			}
+		}
+
+		packed = append(packed, []byte{0x10})
+		unpacked := DecompressBatch(packed, workers)
+		for i, r := range unpacked[:len(packed)-1] {
+			if r.Err != nil || !bytes.Equal(r.Data, jobs[i].Data) {
+				t.Fatal("DecompressBatch on", workers, "workers does not round-trip job", i)
+			}
+		}
+		if unpacked[len(packed)-1].Err == nil {
+			t.Error("DecompressBatch took a truncated header")
+		}
+	}
+}
+
+func TestCompressBest(t *testing.T) {
+	runs := bytes.Repeat([]byte{1, 1, 1, 1, 1, 1, 1, 1, 2}, 10000)
+	for i, data := range append(testdata, runs) {
+		c, method, sizes, err := CompressBest(data)
+		if err != nil {
+			t.Fatal("CompressBest:", err)
+		}
+
+		var want []byte
+		for _, m := range []Method{RLE, LZ77, Huffman4, Huffman8} {
+			w, _ := Compress(m, data)
+			if n := sizes[m]; n != len(w) && (n != -1 || len(w) < len(c)) {
+				t.Error("CompressBest says", m, "came to", n, "for data", i, "but it comes to", len(w))
+			}
+			if want == nil || len(w) < len(want) {
+				want = w
+			}
+			if m == method && !bytes.Equal(c, w) {
+				t.Error("CompressBest output for data", i, "is not that of", m)
+			}
+		}
+		if len(c) != len(want) {
+			t.Error("CompressBest output for data", i, "is", len(c), "bytes, but", len(want), "is possible")
+		}
+	}
+
+	if _, _, _, err := CompressBest(nil); err == nil {
+		t.Error("CompressBest took empty input")
+	}
+}
+
+func TestHuffmanAuto(t *testing.T) {
+	// Noise: the same bits either way, so Huffman4's smaller tree wins.
+	noise := make([]byte, 4096)
+	for i := range noise {
+		noise[i] = byte(i*2654435761>>13) ^ byte(i)
+	}
+	for i, data := range append(testdata, noise) {
+		c4, err := Compress(Huffman4, data)
+		if err != nil {
+			t.Fatal("Compress:", err)
+		}
+		c8, err := Compress(Huffman8, data)
+		if err != nil {
+			t.Fatal("Compress:", err)
+		}
+		want := c8
+		if len(c4) < len(c8) {
+			want = c4
+		}
+
+		c, err := Compress(HuffmanAuto, data)
+		if err != nil {
+			t.Fatal("Compress:", err)
+		}
+		if !bytes.Equal(c, want) {
+			t.Error("HuffmanAuto output for data", i, "is not the smaller of Huffman4 and Huffman8")
+		}
+		if i == len(testdata) && Method(c[0]) != Huffman4 {
+			t.Error("HuffmanAuto did not pick Huffman4 for noise")
+		}
+	}
+}
+
+func TestAppend(t *testing.T) {
+	prefix := []byte("prefix")
+	for _, method := range append(methods, LZ77Wram, HuffmanAuto, Diff8, Diff16) {
+		for i, data := range testdata {
+			data = data[:len(data)&^1]
+			want, err := Compress(method, data)
+			if err != nil {
+				t.Fatal("Compress:", err)
+			}
+			c, err := CompressAppend(prefix, method, data)
+			if err != nil {
+				t.Fatal("CompressAppend:", err)
+			}
+			if !bytes.Equal(c[:len(prefix)], prefix) || !bytes.Equal(c[len(prefix):], want) {
+				t.Fatal("CompressAppend with", method, "differs from Compress for data", i)
+			}
+			d, err := DecompressAppend(prefix, c[len(prefix):])
+			if err != nil {
+				t.Fatal("DecompressAppend:", err)
+			}
+			if !bytes.Equal(d[:len(prefix)], prefix) || !bytes.Equal(d[len(prefix):], data) {
+				t.Fatal("DecompressAppend does not round-trip", method, "for data", i)
+			}
+		}
+	}
+
+	if _, err := DecompressAppend(nil, []byte{0x99, 0, 0, 0}); err != UnknownMethod {
+		t.Error("DecompressAppend took an unknown method")
+	}
+	if _, err := CompressAppend(nil, Diff16, []byte{1, 2, 3}); err != OddSize {
+		t.Error("CompressAppend took an odd size for Diff16")
+	}
+
+	// Reused buffers: nothing to allocate once they are big enough.
+	data := testdata[0][:20000]
+	var c, d []byte
+	for _, method := range []Method{LZ77, Huffman8, RLE} {
+		allocs := testing.AllocsPerRun(10, func() {
+			c, _ = CompressAppend(c[:0], method, data)
+			d, _ = DecompressAppend(d[:0], c)
+		})
+		if allocs > 0 {
+			t.Error("CompressAppend and DecompressAppend with", method, "allocate", allocs, "times a run")
+		}
+		if !bytes.Equal(d, data) {
+			t.Error("reused buffers do not round-trip", method)
+		}
+	}
+}
+
+// Writes data to a compressor in odd-sized pieces.
+func writePieces(t *testing.T, c io.WriteCloser, data []byte) {
+	for len(data) > 0 {
+		n := 1 + len(data)%7777
+		if n > len(data) {
+			n = len(data)
+		}
+		if _, err := c.Write(data[:n]); err != nil {
+			t.Fatal("Write:", err)
+		}
+		data = data[n:]
+	}
+	if err := c.Close(); err != nil {
+		t.Fatal("Close:", err)
+	}
+}
+
+func TestCompressor(t *testing.T) {
+	big := bytes.Repeat(testdata[0], 2)
+	for _, method := range []Method{LZ77, LZ77Wram, RLE} {
+		for _, data := range append(testdata, big) {
+			want, _ := CompressParallel(method, DefaultCompression, data, 1)
+
+			var sized bytes.Buffer
+			writePieces(t, NewSizedCompressor(&sized, method, len(data)), data)
+			if !bytes.Equal(sized.Bytes(), want) {
+				t.Error(method, "sized stream differs from CompressParallel")
+			}
+
+			f, err := ioutil.TempFile("", "gbacomp")
+			if err != nil {
+				t.Fatal(err)
+			}
+			defer os.Remove(f.Name())
+			f.Write([]byte("hdr:"))
+			writePieces(t, NewCompressor(f, method), data)
+			f.Close()
+			patched := load(f.Name())
+			if !bytes.Equal(patched[4:], want) {
+				t.Error(method, "patched stream differs from CompressParallel")
+			}
+		}
+	}
+
+	var buf bytes.Buffer
+	c := NewSizedCompressor(&buf, LZ77, 10)
+	c.Write(testdata[1][:5])
+	if c.Close() != SizeMismatch {
+		t.Error("Short write went unnoticed")
+	}
+}
+
+func TestDecompressor(t *testing.T) {
+	for _, method := range methods {
+		for datai, data := range testdata {
+			c, _ := Compress(method, data)
+			for _, r := range []io.Reader{bytes.NewReader(c), iotest.OneByteReader(bytes.NewReader(c)), iotest.HalfReader(bytes.NewReader(c))} {
+				dec, err := NewDecompressor(r)
+				if err != nil {
+					t.Fatal("NewDecompressor:", err)
+				}
+				d, err := ioutil.ReadAll(iotest.OneByteReader(dec))
+				if err != nil {
+					t.Error(method, testfiles[datai], "ReadAll:", err)
+				}
+				if !bytes.Equal(data, d) {
+					t.Error(method, testfiles[datai], "does not round-trip")
+				}
+			}
+
+			dec, _ := NewDecompressor(bytes.NewReader(c[:len(c)/2]))
+			if _, err := ioutil.ReadAll(dec); err != io.ErrUnexpectedEOF {
+				t.Error(method, "truncated stream gave", err)
+			}
+		}
+	}
+
+	bad := []byte{0x10, 3, 0, 0, 0x80, 0x00, 0x05, 0}
+	dec, _ := NewDecompressor(bytes.NewReader(bad))
+	if _, err := ioutil.ReadAll(dec); err != CorruptData {
+		t.Error("Out-of-range match gave", err)
+	}
+
+	// As for Decompress, a last word cut short reads as if padded
+	// with zeroes.
+	short := []byte{0x28, 4, 0, 0, 1, 0xC0, 'A', 'B', 0}
+	dec, _ = NewDecompressor(bytes.NewReader(short))
+	if d, err := ioutil.ReadAll(dec); err != nil || string(d) != "AAAA" {
+		t.Error("Short last word gave", d, err)
+	}
+}
@@ -1,699 +1,914 @@
-/*
-   Copyright (c) Utkan Güngördü <utkan@freeconsole.org>
-
-   This program is free software; you can redistribute it and/or modify
-   it under the terms of the GNU General Public License as
-   published by the Free Software Foundation; either version 3 or
-   (at your option) any later version.
-
-   This program is distributed in the hope that it will be useful,
-   but WITHOUT ANY WARRANTY; without even the implied warranty of
-
-   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
-
-   GNU General Public License for more details
-
-
-   You should have received a copy of the GNU General Public
-   License along with this program; if not, write to the
-   Free Software Foundation, Inc.,
-   51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
-*/
-
-
-/*----------------------------------------------------------------------------*/
-/*--  huffman.c - Huffman coding for Nintendo GBA/DS                        --*/
-/*--  Copyright (C) 2011 CUE                                                --*/
-/*--                                                                        --*/
-/*--  This program is free software: you can redistribute it and/or modify  --*/
-/*--  it under the terms of the GNU General Public License as published by  --*/
-/*--  the Free Software Foundation, either version 3 of the License, or     --*/
-/*--  (at your option) any later version.                                   --*/
-/*--                                                                        --*/
-/*--  This program is distributed in the hope that it will be useful,       --*/
-/*--  but WITHOUT ANY WARRANTY; without even the implied warranty of        --*/
-/*--  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the          --*/
-/*--  GNU General Public License for more details.                          --*/
-/*--                                                                        --*/
-/*--  You should have received a copy of the GNU General Public License     --*/
-/*--  along with this program. If not, see <http://www.gnu.org/licenses/>.  --*/
-/*----------------------------------------------------------------------------*/
-
-/*----------------------------------------------------------------------------*/
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include "cprs.h"
-
-/*----------------------------------------------------------------------------*/
-#define CMD_DECODE    0x00       // decode
-#define CMD_CODE_20   0x20       // Huffman magic number (to find best mode)
-#define CMD_CODE_28   0x28       // 8-bits Huffman magic number
-#define CMD_CODE_24   0x24       // 4-bits Huffman magic number
-#define CMD_CODE_22   0x22       // 2-bits Huffman magic number (test mode)
-#define CMD_CODE_21   0x21       // 1-bit  Huffman magic number (test mode)
-
-#define HUF_LNODE     0          // left node
-#define HUF_RNODE     1          // right node
-
-#define HUF_SHIFT     1          // bits to shift
-#define HUF_MASK      0x80       // first bit to check (1 << 7)
-#define HUF_MASK4     0x80000000 // first bit to check (HUF_RNODE << 31)
-
-#define HUF_LCHAR     0x80       // next lnode is a char, bit 7, (1 << 7)
-#define HUF_RCHAR     0x40       // next rnode is a char, bit 6, (1 << 6)
-#define HUF_NEXT      0x3F       // inc to next node/char (nwords+1), bits 5-0
-                                 // * (0xFF & ~(HUF_LCHAR | HUF_RCHAR))
-
-#define RAW_MINIM     0x00000000 // empty file, 0 bytes
-#define RAW_MAXIM     0x00FFFFFF // 3-bytes length, 16MB - 1
-
-#define HUF_MINIM     0x00000004 // empty RAW file (header only)
-#define HUF_MAXIM     0x01400000 // 0x01000203, padded to 20MB:
-                                 // * header, 4
-                                 // * tree, 2 * 256
-                                 // * length, RAW_MAXIM
-                                 // 4 + 0x00000200 + 0x00FFFFFF + padding
-
-/*----------------------------------------------------------------------------*/
-typedef struct _huffman_node {
-  unsigned int          symbol;
-  unsigned int          weight;
-  unsigned int          leafs;
-  struct _huffman_node *dad;
-  struct _huffman_node *lson;
-  struct _huffman_node *rson;
-} huffman_node;
-
-typedef struct _huffman_code {
-  unsigned int   nbits;
-  unsigned char *codework;
-} huffman_code;
-
-unsigned int   *freqs;
-huffman_node  **tree;
-unsigned char  *codetree, *codemask;
-huffman_code  **codes;
-unsigned int    num_bits, max_symbols, num_leafs, num_nodes;
-
-/*----------------------------------------------------------------------------*/
-#define BREAK(text) { printf(text); return; }
-#define EXIT(text)  { printf(text); exit(-1); }
-
-/*----------------------------------------------------------------------------*/
-void  Title(void);
-void  Usage(void);
-char *Load(char *file, int filelen);
-void  Save(char *filename, char *buffer, int length);
-char *Memory(int length, int size);
-
-char* HUF_Decode(char *file, int filelen, unsigned int *outsize);
-char* HUF_Encode(char *file, int filelen, int *outsize, int cmd);
-char *HUF_Code(unsigned char *raw_buffer, int raw_len, int *new_len);
-
-void  HUF_InitFreqs(void);
-void  HUF_CreateFreqs(unsigned char *raw_buffer, int raw_len);
-void  HUF_FreeFreqs(void);
-void  HUF_InitTree(void);
-void  HUF_CreateTree(void);
-void  HUF_FreeTree(void);
-void  HUF_InitCodeTree(void);
-void  HUF_CreateCodeTree(void);
-int   HUF_CreateCodeBranch(huffman_node *root, unsigned int p, unsigned int q);
-void  HUF_UpdateCodeTree(void);
-void  HUF_FreeCodeTree(void);
-void  HUF_InitCodeWorks(void);
-void  HUF_CreateCodeWorks(void);
-void  HUF_FreeCodeWorks(void);
-
-
-/*----------------------------------------------------------------------------*/
-char *Load(char *file, int filelen) {
-  char *fb;
-
-  fb = Memory(filelen + 3, sizeof(char));
-  memcpy(fb,file,filelen);
-  return(fb);
-}
-
-/*----------------------------------------------------------------------------*/
-char *Memory(int length, int size) {
-  char *fb;
-
-  fb = (char *) calloc(length, size);
-  if (fb == NULL) EXIT("\nMemory error\n");
-
-  return(fb);
-}
-
-/*----------------------------------------------------------------------------*/
-uint huffman_decode(RECORD *dst, const RECORD *src) {
-	unsigned int outsize;
-	dst->data = HUF_Decode(src->data, src->width*src->height, &outsize);
-	dst->width = 1;
-	dst->height = outsize;
-	
-	return dst->height;
-}
-
-char* HUF_Decode(char *file, int filelen, unsigned int *outsize) {
-  unsigned char *pak_buffer, *raw_buffer, *pak, *raw, *pak_end, *raw_end;
-  unsigned int   pak_len, raw_len, header;
-  unsigned char *tree;
-  unsigned int   pos, next, mask4, code, ch, nbits;
-
-  *outsize = 0;
-
-  pak_buffer = Load(file, filelen);
-  pak_len = filelen;
-
-  header = *pak_buffer;
-
-  if ((header != CMD_CODE_24) && (header != CMD_CODE_28)) {
-    free(pak_buffer);
-    return NULL;
-  }
-
-  num_bits = header & 0xF;
-
-  raw_len = *(unsigned int *)pak_buffer >> 8;
-  raw_buffer = (unsigned char *) Memory(raw_len, sizeof(char));
-
-  pak = pak_buffer + 4;
-  raw = raw_buffer;
-  pak_end = pak_buffer + pak_len;
-  raw_end = raw_buffer + raw_len;
-
-  tree = pak;
-  pak += (*pak + 1) << 1;
-
-  nbits = 0;
-
-  pos = *(tree + 1);
-  next = 0;
-
-  mask4 = 0;
-  while (raw < raw_end) {
-    if (!(mask4 >>= HUF_SHIFT)) {
-      if (pak + 3 >= pak_end) break;
-      code = *(unsigned int *)pak;
-      pak += 4;
-      mask4 = HUF_MASK4;
-    }
-
-    next += ((pos & HUF_NEXT) + 1) << 1;
-
-    if (!(code & mask4)) {
-      ch = pos & HUF_LCHAR;
-      pos = *(tree + next);
-    } else {
-      ch = pos & HUF_RCHAR;
-      pos = *(tree + next + 1);
-    }
-
-    if (ch) {
-      *raw |=  pos << nbits;
-      if (!(nbits = (nbits + num_bits) & 7)) raw++;
-
-      pos = *(tree + 1);
-      next = 0;
-    }    
-  }
-
-  raw_len = raw - raw_buffer;
-
-  if (raw != raw_end) {
-	  //printf("unexpected end of encoded file!");
-  }
-
-  *outsize = raw_len;
-
-  free(pak_buffer);
-
-  return raw_buffer;
-}
-
-/*----------------------------------------------------------------------------*/
-uint huffman_encode(RECORD *dst, const RECORD *src, int data_len) {
-	if (data_len != 4 && data_len != 8) { // TODO(utkan): Huffman1 would be useful when compressing binary data such as obstruction layer; import from upstream.
-		return 0;
-	}
-	
-	int cmd = data_len == 8 ? CMD_CODE_28 : CMD_CODE_24;
-	unsigned int outsize;
-	dst->data = HUF_Encode(src->data, src->width*src->height, &outsize, cmd);
-	dst->width = 1;
-	dst->height = outsize;
-	
-	return dst->height;
-}
-
-
-char* HUF_Encode(char *file, int filelen, int *outsize, int cmd) {
-  unsigned char *raw_buffer, *pak_buffer, *new_buffer;
-  unsigned int   raw_len, pak_len, new_len;
-
-
-  num_bits = cmd & 0xF;
-
-  raw_buffer = Load(file, filelen);
-  raw_len = filelen;
-
-  pak_buffer = NULL;
-  pak_len = HUF_MAXIM + 1;
-
-  if (!num_bits) {
-    num_bits = CMD_CODE_28 - CMD_CODE_20;
-    new_buffer = HUF_Code(raw_buffer, raw_len, &new_len);
-    if (new_len < pak_len) {
-      if (pak_buffer != NULL) free(pak_buffer);
-      pak_buffer = new_buffer;
-      pak_len = new_len;
-    }
-    num_bits = CMD_CODE_24 - CMD_CODE_20;
-  }
-  new_buffer = HUF_Code(raw_buffer, raw_len, &new_len);
-  if (new_len < pak_len) {
-    if (pak_buffer != NULL) free(pak_buffer);
-    pak_buffer = new_buffer;
-    pak_len = new_len;
-  }
-
-  free(raw_buffer);
-
-  *outsize = pak_len;
-  return pak_buffer;
-}
-
-/*----------------------------------------------------------------------------*/
-char *HUF_Code(unsigned char *raw_buffer, int raw_len, int *new_len) {
-  unsigned char *pak_buffer, *pak, *raw, *raw_end, *cod;
-  unsigned int   pak_len, len;
-  huffman_code  *code;
-  unsigned char *cwork, mask;
-  unsigned int  *pk4, mask4, ch, nbits;
-
-  max_symbols = 1 << num_bits;
-
-  pak_len = 4 + (max_symbols << 1) + raw_len + 3;
-  pak_buffer = (unsigned char *) Memory(pak_len, sizeof(char));
-
-  *(unsigned int *)pak_buffer = (CMD_CODE_20 + num_bits) | (raw_len << 8);
-
-  pak = pak_buffer + 4;
-  raw = raw_buffer;
-  raw_end = raw_buffer + raw_len;
-
-  HUF_InitFreqs();
-  HUF_CreateFreqs(raw_buffer, raw_len);
-
-  HUF_InitTree();
-  HUF_CreateTree();
-
-  HUF_InitCodeTree();
-  HUF_CreateCodeTree();
-
-  HUF_InitCodeWorks();
-  HUF_CreateCodeWorks();
-
-  cod = codetree;
-  len = (*cod + 1) << 1;
-  while (len--) *pak++ = *cod++;
-
-  mask4 = 0;
-  while (raw < raw_end) {
-    ch = *raw++;
-
-    for (nbits = 8; nbits; nbits -= num_bits) {
-      code = codes[ch & ((1 << num_bits)-1)];
-      if (code == NULL) EXIT(", ERROR: code without codework!"); // never!
-
-      len   = code->nbits;
-      cwork = code->codework;
-
-      mask = HUF_MASK;
-      while (len--) {
-        if (!(mask4 >>= HUF_SHIFT)) {
-          mask4 = HUF_MASK4;
-          *(pk4 = (unsigned int *)pak) = 0;
-          pak += 4;
-        }
-        if (*cwork & mask) *pk4 |= mask4;
-        if (!(mask >>= HUF_SHIFT)) {
-          mask = HUF_MASK;
-          cwork++;
-        }
-      }
-
-      ch >>= num_bits;
-    }
-  }
-
-  pak_len = pak - pak_buffer;
-
-
-  HUF_FreeCodeWorks();
-  HUF_FreeCodeTree();
-  HUF_FreeTree();
-  HUF_FreeFreqs();
-
-  *new_len = pak_len;
-
-  return(pak_buffer);
-}
-
-/*----------------------------------------------------------------------------*/
-void HUF_InitFreqs(void) {
-  unsigned int i;
-
-  freqs = (unsigned int *) Memory(max_symbols, sizeof(int));
-
-  for (i = 0; i < max_symbols; i++) freqs[i] = 0;
-}
-
-/*----------------------------------------------------------------------------*/
-void HUF_CreateFreqs(unsigned char *raw_buffer, int raw_len) {
-  unsigned int ch, nbits;
-  unsigned int i;
-
-  for (i = 0; i < raw_len; i++) {
-    ch = *raw_buffer++;
-    for (nbits = 8; nbits; nbits -= num_bits) {
-      freqs[ch >> (8 - num_bits)]++;
-      ch = (ch << num_bits) & 0xFF;
-    }
-  }
-
-  num_leafs = 0;
-  for (i = 0; i < max_symbols; i++) if (freqs[i]) num_leafs++;
-
-
-  if (num_leafs < 2) {
-    if (num_leafs == 1) {
-      for (i = 0; i < max_symbols; i++) {
-        if (freqs[i]) {
-          freqs[i] = 1;
-          break;
-        }
-      }
-    }
-
-    while (num_leafs++ < 2) {
-      for (i = 0; i < max_symbols; i++) {
-        if (!freqs[i]) {
-          freqs[i] = 2;
-          break;
-        }
-      }
-    }
-  }
-
-  num_nodes = (num_leafs << 1) - 1;
-}
-
-/*----------------------------------------------------------------------------*/
-void HUF_FreeFreqs(void) {
-  free(freqs);
-}
-
-/*----------------------------------------------------------------------------*/
-void HUF_InitTree(void) {
-  unsigned int i;
-
-  tree = (huffman_node **) Memory(num_nodes, sizeof(huffman_node *));
-
-  for (i = 0; i < num_nodes; i++) tree[i] = NULL;
-}
-
-/*----------------------------------------------------------------------------*/
-void HUF_CreateTree(void) {
-  huffman_node *node, *lnode, *rnode;
-  unsigned int  lweight, rweight, num_node;
-  unsigned int  i;
-
-  num_node = 0;
-  for (i = 0; i < max_symbols; i++) {
-    if (freqs[i]) {
-      node = (huffman_node *) Memory(1, sizeof(huffman_node));
-      tree[num_node++] = node;
-
-      node->symbol = i;
-      node->weight = freqs[i];
-      node->leafs  = 1;
-      node->dad    = NULL;
-      node->lson   = NULL;
-      node->rson   = NULL;
-    }
-  }
-
-  while (num_node < num_nodes) {
-    lnode = rnode = NULL;
-    lweight = rweight = 0;
-
-    for (i = 0; i < num_node; i++) {
-      if (tree[i]->dad == NULL) {
-        if (!lweight || (tree[i]->weight < lweight)) {
-          rweight = lweight;
-          rnode   = lnode;
-          lweight = tree[i]->weight;
-          lnode   = tree[i];
-        } else if (!rweight || (tree[i]->weight < rweight)) {
-          rweight = tree[i]->weight;
-          rnode   = tree[i];
-        }
-      }
-    }
-
-    node = (huffman_node *) Memory(1, sizeof(huffman_node));
-    tree[num_node++] = node;
-
-    node->symbol = num_node - num_leafs + max_symbols;
-    node->weight = lnode->weight + rnode->weight;
-    node->leafs  = lnode->leafs + rnode->leafs;
-    node->dad    = NULL;
-    node->lson   = lnode;
-    node->rson   = rnode;
-
-    lnode->dad = rnode->dad = node;
-  }
-}
-
-/*----------------------------------------------------------------------------*/
-void HUF_FreeTree(void) {
-  unsigned int i;
-
-  for (i = 0; i < num_nodes; i++) free(tree[i]);
-  free(tree);
-}
-
-/*----------------------------------------------------------------------------*/
-void HUF_InitCodeTree(void) {
-  unsigned int max_nodes;
-  unsigned int i;
-
-  max_nodes = (((num_leafs - 1) | 1) + 1) << 1;
-
-  codetree = (unsigned char *) Memory(max_nodes, sizeof(char));
-  codemask = (unsigned char *) Memory(max_nodes, sizeof(char));
-
-  for (i = 0; i < max_nodes; i++) {
-    codetree[i] = 0;
-    codemask[i] = 0;
-  }
-}
-
-/*----------------------------------------------------------------------------*/
-void HUF_CreateCodeTree(void) {
-  unsigned int i;
-
-  i = 0;
-
-  codetree[i] = (num_leafs - 1) | 1;
-  codemask[i] = 0;
-
-  HUF_CreateCodeBranch(tree[num_nodes - 1], i + 1, i + 2);
-  HUF_UpdateCodeTree();
-
-  i = (codetree[0] + 1) << 1;
-  while (--i) if (codemask[i] != 0xFF) codetree[i] |= codemask[i];
-}
-
-/*----------------------------------------------------------------------------*/
-int HUF_CreateCodeBranch(huffman_node *root, unsigned int p, unsigned int q) {
-  huffman_node **stack, *node;
-  unsigned int  r, s, mask;
-  unsigned int  l_leafs, r_leafs;
-
-  if (root->leafs <= HUF_NEXT + 1) {
-    stack = (huffman_node **) Memory(2*root->leafs, sizeof(huffman_node *));
-
-    s = r = 0;
-    stack[r++] = root;
-
-    while (s < r) {
-      if ((node = stack[s++])->leafs == 1) {
-        if (s == 1) { codetree[p] = node->symbol; codemask[p]   = 0xFF; }
-        else        { codetree[q] = node->symbol; codemask[q++] = 0xFF; }
-      } else {
-        mask = 0;
-        if (node->lson->leafs == 1) mask |= HUF_LCHAR;
-        if (node->rson->leafs == 1) mask |= HUF_RCHAR;
-
-        if (s == 1) { codetree[p] = (r - s) >> 1; codemask[p]   = mask; }
-        else        { codetree[q] = (r - s) >> 1; codemask[q++] = mask; }
-
-        stack[r++] = node->lson;
-        stack[r++] = node->rson;
-      }
-    }
-
-    free(stack);
-  } else {
-    mask = 0;
-    if (root->lson->leafs == 1) mask |= HUF_LCHAR;
-    if (root->rson->leafs == 1) mask |= HUF_RCHAR;
-
-    codetree[p] = 0; codemask[p] = mask;
-
-    if (root->lson->leafs <= root->rson->leafs) {
-      l_leafs = HUF_CreateCodeBranch(root->lson, q,     q + 2);
-      r_leafs = HUF_CreateCodeBranch(root->rson, q + 1, q + (l_leafs << 1));
-      codetree[q + 1] = l_leafs - 1;
-    } else {
-      r_leafs = HUF_CreateCodeBranch(root->rson, q + 1, q + 2);
-      l_leafs = HUF_CreateCodeBranch(root->lson, q,     q + (r_leafs << 1));
-      codetree[q] = r_leafs - 1;
-    }
-  }
-
-  return(root->leafs);
-}
-
-/*----------------------------------------------------------------------------*/
-void HUF_UpdateCodeTree(void) {
-  unsigned int max, inc, n0, n1, l0, l1, tmp0, tmp1;
-  unsigned int i, j, k;
-
-  max = (codetree[0] + 1) << 1;
-
-  for (i = 1; i < max; i++) {
-    if ((codemask[i] != 0xFF) && (codetree[i] > HUF_NEXT)) {
-      if ((i & 1) && (codetree[i-1] == HUF_NEXT)) {
-        i--;
-        inc = 1;
-      } else if (!(i & 1) && (codetree[i+1] == HUF_NEXT)) {
-        i++;
-        inc = 1;
-      } else {
-        inc = codetree[i] - HUF_NEXT;
-      }
-
-      n1 = (i >> 1) + 1 + codetree[i];
-      n0 = n1 - inc;
-
-      l1 = n1 << 1;
-      l0 = n0 << 1;
-
-      tmp0 = *(short *)(codetree + l1);
-      tmp1 = *(short *)(codemask + l1);
-      for (j = l1; j > l0; j -= 2) {
-        *(short *)(codetree + j) = *(short *)(codetree + j - 2);
-        *(short *)(codemask + j) = *(short *)(codemask + j - 2);
-      }
-      *(short *)(codetree + l0) = tmp0;
-      *(short *)(codemask + l0) = tmp1;
-
-      codetree[i] -= inc;
-
-      for (j = i + 1; j < l0; j++) {
-        if (codemask[j] != 0xFF) {
-          k = (j >> 1) + 1 + codetree[j];
-          if ((k >= n0) && (k < n1)) codetree[j]++;
-        }
-      }
-
-      if (codemask[l0 + 0] != 0xFF) codetree[l0 + 0] += inc;
-      if (codemask[l0 + 1] != 0xFF) codetree[l0 + 1] += inc;
-
-      for (j = l0 + 2; j < l1 + 2; j++) {
-        if (codemask[j] != 0xFF) {
-          k = (j >> 1) + 1 + codetree[j];
-          if (k > n1) codetree[j]--;
-        }
-      }
-
-      i = (i | 1) - 2;
-    }
-  }
-}
-
-/*----------------------------------------------------------------------------*/
-void HUF_FreeCodeTree(void) {
-  free(codemask);
-  free(codetree);
-}
-
-/*----------------------------------------------------------------------------*/
-void HUF_InitCodeWorks(void) {
-  unsigned int i;
-
-  codes = (huffman_code **) Memory(max_symbols, sizeof(huffman_code *));
-
-  for (i = 0; i < max_symbols; i++) codes[i] = NULL;
-}
-
-/*----------------------------------------------------------------------------*/
-void HUF_CreateCodeWorks(void) {
-  huffman_node  *node;
-  huffman_code  *code;
-  unsigned int   symbol, nbits, maxbytes, nbit;
-  unsigned char  scode[100], mask;
-  unsigned int   i, j;
-
-  for (i = 0; i < num_leafs; i++) {
-    node   = tree[i];
-    symbol = node->symbol;
-
-    nbits = 0;
-    while (node->dad != NULL) {
-      scode[nbits++] = node->dad->lson == node ? HUF_LNODE : HUF_RNODE;
-      node = node->dad;
-    }
-    maxbytes = (nbits + 7) >> 3;
-
-    code = (huffman_code *) Memory(1, sizeof(huffman_code));
-
-    codes[symbol]  = code;
-    code->nbits    = nbits;
-    code->codework = (unsigned char *) Memory(maxbytes, sizeof(char));
-
-    for (j = 0; j < maxbytes; j++) code->codework[j] = 0;
-
-    mask = HUF_MASK;
-    j = 0;
-    for (nbit = nbits; nbit; nbit--) {
-      if (scode[nbit-1]) code->codework[j] |= mask;
-      if (!(mask >>= HUF_SHIFT)) {
-        mask = HUF_MASK;
-        j++;
-      }
-    }
-  }
-}
-
-/*----------------------------------------------------------------------------*/
-void HUF_FreeCodeWorks(void) {
-  unsigned int i;
-
-  for (i = 0; i < max_symbols; i++) {
-    if (codes[i] != NULL) {
-      free(codes[i]->codework);
-      free(codes[i]);
-    }
-  }
-  free(codes);
-}
-
-/*----------------------------------------------------------------------------*/
-/*--  EOF                                           Copyright (C) 2011 CUE  --*/
-/*----------------------------------------------------------------------------*/
+/*
+   Copyright (c) Utkan Güngördü <utkan@freeconsole.org>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 3 or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+
+   GNU General Public License for more details
+
+
+   You should have received a copy of the GNU General Public
+   License along with this program; if not, write to the
+   Free Software Foundation, Inc.,
+   51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+
+/*----------------------------------------------------------------------------*/
+/*--  huffman.c - Huffman coding for Nintendo GBA/DS                        --*/
+/*--  Copyright (C) 2011 CUE                                                --*/
+/*--                                                                        --*/
+/*--  This program is free software: you can redistribute it and/or modify  --*/
+/*--  it under the terms of the GNU General Public License as published by  --*/
+/*--  the Free Software Foundation, either version 3 of the License, or     --*/
+/*--  (at your option) any later version.                                   --*/
+/*--                                                                        --*/
+/*--  This program is distributed in the hope that it will be useful,       --*/
+/*--  but WITHOUT ANY WARRANTY; without even the implied warranty of        --*/
+/*--  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the          --*/
+/*--  GNU General Public License for more details.                          --*/
+/*--                                                                        --*/
+/*--  You should have received a copy of the GNU General Public License     --*/
+/*--  along with this program. If not, see <http://www.gnu.org/licenses/>.  --*/
+/*----------------------------------------------------------------------------*/
+
+/*----------------------------------------------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "cprs.h"
+
+/*----------------------------------------------------------------------------*/
+#define CMD_DECODE    0x00       // decode
+#define CMD_CODE_20   0x20       // Huffman magic number (to find best mode)
+#define CMD_CODE_28   0x28       // 8-bits Huffman magic number
+#define CMD_CODE_24   0x24       // 4-bits Huffman magic number
+#define CMD_CODE_22   0x22       // 2-bits Huffman magic number
+#define CMD_CODE_21   0x21       // 1-bit  Huffman magic number
+
+#define HUF_HEADER(h) (((h) == CMD_CODE_21) || ((h) == CMD_CODE_22) || \
+                       ((h) == CMD_CODE_24) || ((h) == CMD_CODE_28))
+
+#define HUF_LNODE     0          // left node
+#define HUF_RNODE     1          // right node
+
+#define HUF_SHIFT     1          // bits to shift
+#define HUF_MASK      0x80       // first bit to check (1 << 7)
+#define HUF_MASK4     0x80000000 // first bit to check (HUF_RNODE << 31)
+
+#define HUF_LCHAR     0x80       // next lnode is a char, bit 7, (1 << 7)
+#define HUF_RCHAR     0x40       // next rnode is a char, bit 6, (1 << 6)
+#define HUF_NEXT      0x3F       // inc to next node/char (nwords+1), bits 5-0
+                                 // * (0xFF & ~(HUF_LCHAR | HUF_RCHAR))
+
+#define RAW_MINIM     0x00000000 // empty file, 0 bytes
+#define RAW_MAXIM     0x00FFFFFF // 3-bytes length, 16MB - 1
+
+#define HUF_FREQ_MT   0x00100000 // inputs this big get counted on threads
+#define HUF_FREQ_THR  8          // most threads to count on
+
+#define HUF_MINIM     0x00000004 // empty RAW file (header only)
+#define HUF_MAXIM     0x01400000 // 0x01000203, padded to 20MB:
+                                 // * header, 4
+                                 // * tree, 2 * 256
+                                 // * length, RAW_MAXIM
+                                 // 4 + 0x00000200 + 0x00FFFFFF + padding
+
+/*----------------------------------------------------------------------------*/
+typedef struct _huffman_node {
+  unsigned int          symbol;
+  unsigned int          weight;
+  unsigned int          leafs;
+  struct _huffman_node *dad;
+  struct _huffman_node *lson;
+  struct _huffman_node *rson;
+} huffman_node;
+
+typedef struct _huffman_code {
+  unsigned int       nbits;
+  unsigned long long code;               // the bits, first one highest
+} huffman_code;
+
+// What the next lut_bits bits of a code word decode to: count symbols,
+// taking used bits, or if count is 0, the node a long code got to.
+typedef struct _huffman_lut {
+  unsigned int   syms;                   // up to 32 bits of them, first lowest
+  unsigned char  count, used;
+  unsigned short node;
+} huffman_lut;
+
+#define HUF_LUT_BITS1 12         // lookup bits for 1- and 2-bits Huffman
+#define HUF_LUT_BITS4 10         // lookup bits for 4-bits Huffman
+#define HUF_LUT_BITS8 11         // lookup bits for 8-bits Huffman
+#define HUF_BAD_NODE  0xFFFF     // offset out of the tree
+
+// A piece of the input to count on a thread.
+typedef struct _huffman_count {
+  const unsigned char *raw;
+  unsigned int         len;
+  unsigned int         hist[256];
+} huffman_count;
+
+// Everything an encode needs, sized for 256 symbols so nothing has to be
+// allocated on the way.
+struct HUFCTX {
+  unsigned int   hist[256], freqs[256];
+  huffman_node  *tree[511], nodes[511], *leafs[256];
+  huffman_node  *wait[511];
+  unsigned int   at[511];
+  unsigned char  codetree[512];
+  huffman_code   codes[256], table[256];
+  unsigned int   num_bits, max_symbols, num_leafs, num_nodes;
+  const unsigned int *limit;             // give up past this size, or NULL
+};
+
+struct HUFDSTREAM {
+  unsigned char  head[4];                // header, as far as it's come in
+  unsigned int   headS;
+  unsigned int   raw_len, done;          // output size and how much is out
+  unsigned char  tree[512];              // tree, as far as it's come in
+  unsigned int   treeS, treeN;
+  unsigned int   code, codeN;            // current word, bytes of it in
+  unsigned int   mask4, node;            // where we are in word and tree
+  unsigned int   end;                    // no more input to come
+  unsigned int   num_bits, nbits, ch;    // output byte being put together
+};
+
+/*----------------------------------------------------------------------------*/
+#define BREAK(text) { printf(text); return; }
+
+/*----------------------------------------------------------------------------*/
+void  Title(void);
+void  Usage(void);
+void  Save(char *filename, char *buffer, int length);
+
+int   HUF_Decode(const unsigned char *file, int filelen, unsigned char *raw_buffer, unsigned int raw_max);
+int   HUF_Encode(HUFCTX *ctx, const unsigned char *raw_buffer, int raw_len, unsigned char *pak_buffer, int pak_max, int cmd);
+int   HUF_Code(HUFCTX *ctx, const unsigned char *raw_buffer, int raw_len, unsigned char *pak_buffer, int pak_max);
+void  HUF_CreateCodes(HUFCTX *ctx);
+unsigned int HUF_CodeSize(const HUFCTX *ctx);
+int   HUF_Step(const unsigned char *tree, unsigned int tree_len, unsigned int node, unsigned int bit, unsigned int *leaf);
+void  HUF_CreateLUT(const unsigned char *tree, unsigned int tree_len, huffman_lut *lut, unsigned int lut_bits, unsigned int sym_bits);
+
+void  HUF_CreateHistogram(HUFCTX *ctx, const unsigned char *raw_buffer, int raw_len);
+void  HUF_CreateFreqs(HUFCTX *ctx);
+void  HUF_Histogram(const unsigned char *raw, unsigned int len, unsigned int *hist);
+void *HUF_CountThread(void *arg);
+void  HUF_CreateTree(HUFCTX *ctx);
+int   HUF_CompareLeafs(const void *a, const void *b);
+int   HUF_CreateCodeTree(HUFCTX *ctx);
+unsigned char HUF_CodeFlags(const huffman_node *node);
+void  HUF_CreateCodeWorks(HUFCTX *ctx);
+
+
+/*----------------------------------------------------------------------------*/
+uint huffman_decode(RECORD *dst, const RECORD *src) {
+  unsigned char *raw_buffer;
+  int            raw_len;
+
+  raw_len = cprs_decompress_size(src->data, src->width*src->height);
+  if (raw_len < 0) return 0;
+
+  raw_buffer = (unsigned char *) malloc(raw_len ? raw_len : 1);
+  if (raw_buffer == NULL) return 0;
+
+  raw_len = huffman_decode_buf(raw_buffer, raw_len, src->data, src->width*src->height);
+  if (raw_len < 0) {
+    free(raw_buffer);
+    return 0;
+  }
+
+  rec_attach(dst, raw_buffer, 1, raw_len);
+  return raw_len;
+}
+
+/*----------------------------------------------------------------------------*/
+/* Decodes src where it is. The tree offsets and the input length are        */
+/* checked, and exactly the size in the header is written.                   */
+int huffman_decode_buf(BYTE *dst, uint dstS, const BYTE *src, uint srcS) {
+  if ((dst == NULL) || (src == NULL)) return CPRS_ERR_ARG;
+  if (srcS < 4) return CPRS_ERR_DATA;
+
+  return HUF_Decode(src, srcS, dst, dstS);
+}
+
+int HUF_Decode(const unsigned char *file, int filelen, unsigned char *raw_buffer, unsigned int raw_max) {
+  const unsigned char *pak, *pak_end, *tree;
+  unsigned char      *raw, *raw_end;
+  unsigned int        raw_len, header, tree_len, sym_bits, lut_bits;
+  huffman_lut        *lut, *entry;
+  unsigned long long  bits, out;
+  unsigned int        nbits, outn, node, leaf, word, flip;
+  int                 next;
+
+  header = *file;
+
+  if (!HUF_HEADER(header)) {
+    return CPRS_ERR_DATA;
+  }
+
+  raw_len = read32le(file) >> 8;
+  if (raw_len > raw_max) return CPRS_ERR_SPACE;
+  if (!raw_len) return 0;
+
+  sym_bits = header & 0xF;
+  lut_bits = sym_bits == 8 ? HUF_LUT_BITS8 : sym_bits == 4 ? HUF_LUT_BITS4 : HUF_LUT_BITS1;
+
+  if (filelen < 5) return CPRS_ERR_DATA;
+  tree = file + 4;
+  tree_len = (*tree + 1) << 1;
+  if (4 + tree_len > (unsigned int)filelen) return CPRS_ERR_DATA;
+
+  lut = (huffman_lut *) malloc(sizeof(huffman_lut) << lut_bits);
+  if (lut == NULL) return CPRS_ERR_MEM;
+  HUF_CreateLUT(tree, tree_len, lut, lut_bits, sym_bits);
+
+  pak = tree + tree_len;
+  pak_end = file + filelen;
+  raw = raw_buffer;
+  raw_end = raw_buffer + raw_len;
+
+  // The code words come in 32bit words from the top; bits holds the
+  // nbits that haven't been used yet, also from the top. A short last
+  // word reads as if padded with zeroes. Symbols go into out from the
+  // bottom, outn bits of them, until there's a byte.
+  // 1-bit codes for 1-bit symbols: each code word is 32 symbols, in
+  // reverse order within each byte, possibly inverted.
+  if ((sym_bits == 1) && (tree_len == 4) && ((tree[1] & ~HUF_NEXT) == (HUF_LCHAR | HUF_RCHAR)) &&
+      !(tree[1] & HUF_NEXT) && ((tree[2] ^ tree[3]) & 1)) {
+    flip = tree[2] & 1 ? 0xFFFFFFFF : 0;
+    while ((raw + 4 <= raw_end) && (pak + 4 <= pak_end)) {
+      word = read32le(pak);
+      word = ((word >> 1) & 0x55555555) | ((word & 0x55555555) << 1);
+      word = ((word >> 2) & 0x33333333) | ((word & 0x33333333) << 2);
+      word = ((word >> 4) & 0x0F0F0F0F) | ((word & 0x0F0F0F0F) << 4);
+      word = (word >> 24) | ((word >> 8) & 0xFF00) | ((word << 8) & 0xFF0000) | (word << 24);
+      write32le(raw, word ^ flip);
+      pak += 4;
+      raw += 4;
+    }
+  }
+
+  bits = 0;
+  nbits = 0;
+  out = 0;
+  outn = 0;
+  while (raw < raw_end) {
+    while ((nbits <= 32) && (pak < pak_end)) {
+      if (pak + 4 <= pak_end) {
+        word = read32le(pak);
+        pak += 4;
+      } else {
+        for (word = 0, next = 0; pak < pak_end; next += 8) word |= (unsigned int)*pak++ << next;
+      }
+      bits |= (unsigned long long)word << (32 - nbits);
+      nbits += 32;
+    }
+
+    entry = nbits >= lut_bits ? &lut[bits >> (64 - lut_bits)] : NULL;
+    if ((entry != NULL) && entry->count) {
+      out |= (unsigned long long)entry->syms << outn;
+      outn += entry->count * sym_bits;
+      bits <<= entry->used;
+      nbits -= entry->used;
+    } else {
+      node = 1;
+      if (entry != NULL) {
+        if (entry->node == HUF_BAD_NODE) break;
+
+        // A long one: carry on from where the table left off.
+        node = entry->node;
+        bits <<= lut_bits;
+        nbits -= lut_bits;
+      }
+
+      for (leaf = 0; !leaf && nbits; nbits--, bits <<= 1) {
+        if ((next = HUF_Step(tree, tree_len, node, bits >> 63, &leaf)) < 0) break;
+        node = next;
+      }
+      if (!leaf) break;
+
+      out |= (unsigned long long)(tree[node] & ((1 << sym_bits) - 1)) << outn;
+      outn += sym_bits;
+    }
+
+    while ((outn >= 8) && (raw < raw_end)) {
+      *raw++ = (unsigned char) out;
+      out >>= 8;
+      outn -= 8;
+    }
+  }
+
+  free(lut);
+
+  if (raw != raw_end) {
+	  //printf("unexpected end of encoded file!");
+    return CPRS_ERR_DATA;
+  }
+
+  return raw_len;
+}
+
+/*----------------------------------------------------------------------------*/
+/* One step down from tree[node]: the index of its child on the bit side,    */
+/* with leaf set if that's a symbol, or -1 if the offset is out of the tree. */
+int HUF_Step(const unsigned char *tree, unsigned int tree_len, unsigned int node, unsigned int bit, unsigned int *leaf) {
+  unsigned int next;
+
+  next = (node & ~1) + (((tree[node] & HUF_NEXT) + 1) << 1) + bit;
+  if (next >= tree_len) return -1;
+
+  *leaf = tree[node] & (bit ? HUF_RCHAR : HUF_LCHAR);
+  return next;
+}
+
+/*----------------------------------------------------------------------------*/
+/* Decode every lut_bits bit pattern as far as whole symbols go.             */
+void HUF_CreateLUT(const unsigned char *tree, unsigned int tree_len, huffman_lut *lut, unsigned int lut_bits, unsigned int sym_bits) {
+  huffman_lut  *entry;
+  unsigned int  pattern, node, leaf, b;
+  int           next;
+
+  for (pattern = 0; pattern < (1U << lut_bits); pattern++) {
+    entry = &lut[pattern];
+    entry->syms = entry->count = entry->used = 0;
+
+    node = 1;
+    for (b = 1; b <= lut_bits; b++) {
+      if ((next = HUF_Step(tree, tree_len, node, (pattern >> (lut_bits - b)) & 1, &leaf)) < 0) {
+        node = HUF_BAD_NODE;
+        break;
+      }
+      node = next;
+      if (leaf) {
+        entry->syms |= (unsigned int)(tree[node] & ((1 << sym_bits) - 1)) << (entry->count * sym_bits);
+        entry->used = b;
+        node = 1;
+        if (++entry->count * sym_bits == 32) break;
+      }
+    }
+    entry->node = node;
+  }
+}
+
+/*----------------------------------------------------------------------------*/
+HUFDSTREAM *huffman_dstream_init(void) {
+  HUFDSTREAM *st;
+
+  st = (HUFDSTREAM *) calloc(1, sizeof(HUFDSTREAM));
+  return st;
+}
+
+/*----------------------------------------------------------------------------*/
+/* Same as HUF_Decode, a bit at a time, with the same checks on the tree.    */
+int huffman_dstream_decode(HUFDSTREAM *st, BYTE *dst, uint dstS,
+                           const BYTE *src, uint srcS, uint *used) {
+  const unsigned char *pak, *pak_end;
+  unsigned char       *raw, *raw_end;
+  unsigned int         header, leaf;
+  int                  next;
+
+  if ((st == NULL) || (used == NULL)) return CPRS_ERR_ARG;
+  if (((dst == NULL) && dstS) || ((src == NULL) && srcS)) return CPRS_ERR_ARG;
+
+  pak = src;
+  pak_end = src + srcS;
+  raw = dst;
+
+  while ((st->headS < 4) && (pak < pak_end)) st->head[st->headS++] = *pak++;
+  if (st->headS < 4) {
+    *used = srcS;
+    return 0;
+  }
+
+  header = st->head[0];
+  if (!HUF_HEADER(header)) return CPRS_ERR_DATA;
+  st->num_bits = header & 0xF;
+  st->raw_len = read32le(st->head) >> 8;
+  raw_end = dst + MIN(dstS, st->raw_len - st->done);
+
+  if (!st->treeS && (pak < pak_end)) {
+    st->treeS = (*pak + 1) << 1;
+    st->tree[st->treeN++] = *pak++;
+  }
+  while ((st->treeN < st->treeS) && (pak < pak_end)) {
+    st->tree[st->treeN++] = *pak++;
+    if (st->treeN == st->treeS) st->node = 1;
+  }
+  if ((st->treeN < st->treeS) || !st->treeS) {
+    *used = pak - src;
+    return 0;
+  }
+
+  while (raw < raw_end) {
+    if (!st->mask4) {
+      while ((st->codeN < 4) && (pak < pak_end))
+        st->code |= (unsigned int)*pak++ << (st->codeN++ << 3);
+      // A short last word reads as if padded with zeroes.
+      if ((st->codeN < 4) && (!st->end || !st->codeN)) break;
+      st->mask4 = HUF_MASK4;
+    }
+
+    next = HUF_Step(st->tree, st->treeS, st->node, (st->code & st->mask4) != 0, &leaf);
+    if (next < 0) return CPRS_ERR_DATA;
+    st->node = next;
+
+    if (!(st->mask4 >>= HUF_SHIFT)) st->code = st->codeN = 0;
+
+    if (leaf) {
+      st->ch |= (st->tree[st->node] & ((1 << st->num_bits) - 1)) << st->nbits;
+      if (!(st->nbits = (st->nbits + st->num_bits) & 7)) {
+        *raw++ = st->ch;
+        st->ch = 0;
+      }
+
+      st->node = 1;
+    }
+  }
+  st->done += raw - dst;
+
+  *used = pak - src;
+  return raw - dst;
+}
+
+/*----------------------------------------------------------------------------*/
+/* There's no more input for st, so what's left of a last word cut short     */
+/* can be decoded, as HUF_Decode would.                                      */
+void huffman_dstream_end(HUFDSTREAM *st) {
+  st->end = 1;
+}
+
+/*----------------------------------------------------------------------------*/
+int huffman_dstream_left(const HUFDSTREAM *st) {
+  return st->headS < 4 ? -1 : (int)(st->raw_len - st->done);
+}
+
+/*----------------------------------------------------------------------------*/
+void huffman_dstream_destroy(HUFDSTREAM *st) {
+  free(st);
+}
+
+/*----------------------------------------------------------------------------*/
+/* A context for encoding; one per thread. It holds all the memory an       */
+/* encode works in, so encoding with one doesn't allocate anything.         */
+HUFCTX *huffman_create(void) {
+  return (HUFCTX *) malloc(sizeof(HUFCTX));
+}
+
+/*----------------------------------------------------------------------------*/
+void huffman_destroy(HUFCTX *ctx) {
+  free(ctx);
+}
+
+/*----------------------------------------------------------------------------*/
+uint huffman_encode(RECORD *dst, const RECORD *src, int data_len) {
+  return huffman_encode_ctx(NULL, dst, src, data_len);
+}
+
+/*----------------------------------------------------------------------------*/
+uint huffman_encode_ctx(HUFCTX *ctx, RECORD *dst, const RECORD *src, int data_len) {
+  unsigned char *pak_buffer;
+  int            raw_len, pak_len;
+
+  raw_len = src->width*src->height;
+  pak_len = cprs_compress_bound(raw_len, CMD_CODE_20 + data_len);
+  pak_buffer = (unsigned char *) malloc(pak_len);
+  if (pak_buffer == NULL) return 0;
+
+  pak_len = huffman_encode_buf(ctx, pak_buffer, pak_len, src->data, raw_len, data_len);
+  if (pak_len < 0) {
+    free(pak_buffer);
+    return 0;
+  }
+
+  rec_attach_fit(dst, pak_buffer, pak_len);
+  return pak_len;
+}
+
+/*----------------------------------------------------------------------------*/
+/* ctx may be NULL for a temporary one.                                      */
+int huffman_encode_buf(HUFCTX *ctx, BYTE *dst, uint dstS, const BYTE *src, uint srcS, int data_len) {
+  return huffman_encode_limit(ctx, dst, dstS, src, srcS, data_len, NULL);
+}
+
+/*----------------------------------------------------------------------------*/
+/* Gives up with CPRS_ERR_SPACE if the output would be bigger than *limit,   */
+/* which other threads may lower in the meantime. The size is known before  */
+/* anything gets written, so that's the only check.                          */
+int huffman_encode_limit(HUFCTX *ctx, BYTE *dst, uint dstS, const BYTE *src, uint srcS, int data_len, const uint *limit) {
+  HUFCTX *tmp;
+  int     pak_len;
+
+  if ((data_len != 0) && (data_len != 1) && (data_len != 2) && (data_len != 4) && (data_len != 8)) {
+    return CPRS_ERR_ARG;
+  }
+  if ((dst == NULL) || ((src == NULL) && srcS) || (srcS > RAW_MAXIM)) return CPRS_ERR_ARG;
+
+  tmp = NULL;
+  if ((ctx == NULL) && ((ctx = tmp = huffman_create()) == NULL)) return CPRS_ERR_MEM;
+
+  ctx->limit = limit;
+  pak_len = HUF_Encode(ctx, src, srcS, dst, dstS, CMD_CODE_20 + data_len);
+
+  huffman_destroy(tmp);
+
+  return pak_len;
+}
+
+int HUF_Encode(HUFCTX *ctx, const unsigned char *raw_buffer, int raw_len, unsigned char *pak_buffer, int pak_max, int cmd) {
+  unsigned int pak_len;
+
+  HUF_CreateHistogram(ctx, raw_buffer, raw_len);
+
+  ctx->num_bits = cmd & 0xF;
+
+  // Best mode: the code lengths tell what each would come to, so
+  // only the smaller gets encoded. 8-bits wins ties.
+  if (!ctx->num_bits) {
+    ctx->num_bits = CMD_CODE_28 - CMD_CODE_20;
+    HUF_CreateCodes(ctx);
+    pak_len = HUF_CodeSize(ctx);
+
+    ctx->num_bits = CMD_CODE_24 - CMD_CODE_20;
+    HUF_CreateCodes(ctx);
+    if (HUF_CodeSize(ctx) < pak_len) return HUF_Code(ctx, raw_buffer, raw_len, pak_buffer, pak_max);
+
+    ctx->num_bits = CMD_CODE_28 - CMD_CODE_20;
+  }
+
+  HUF_CreateCodes(ctx);
+  return HUF_Code(ctx, raw_buffer, raw_len, pak_buffer, pak_max);
+}
+
+/*----------------------------------------------------------------------------*/
+/* The tree and the codes for num_bits symbols, from the byte histogram,     */
+/* and the codes for all the symbols in each byte, low ones first.           */
+void HUF_CreateCodes(HUFCTX *ctx) {
+  huffman_code *code;
+  unsigned int  ch, n, i;
+
+  ctx->max_symbols = 1 << ctx->num_bits;
+
+  HUF_CreateFreqs(ctx);
+  HUF_CreateTree(ctx);
+
+  // A tree too lopsided to lay out gets rebuilt from flatter weights,
+  // each halved but kept above 0, so the order stays and the codes
+  // just get a little longer. With all of them 1 the tree is as even
+  // as can be, and those lay out for any number of leafs.
+  while (!HUF_CreateCodeTree(ctx)) {
+    for (i = 0; i < ctx->max_symbols; i++)
+      if (ctx->freqs[i]) ctx->freqs[i] = (ctx->freqs[i] >> 1) | 1;
+    HUF_CreateTree(ctx);
+  }
+  HUF_CreateCodeWorks(ctx);
+
+  for (i = 0; i < 256; i++) {
+    ctx->table[i].code = ctx->table[i].nbits = 0;
+    for (ch = i, n = 8; n; n -= ctx->num_bits, ch >>= ctx->num_bits) {
+      code = &ctx->codes[ch & (ctx->max_symbols - 1)];
+      ctx->table[i].code = (ctx->table[i].code << code->nbits) | code->code;
+      ctx->table[i].nbits += code->nbits;
+    }
+  }
+}
+
+/*----------------------------------------------------------------------------*/
+/* Exactly what HUF_Code will write with the codes as they are.              */
+unsigned int HUF_CodeSize(const HUFCTX *ctx) {
+  unsigned long long bits;
+  unsigned int       i;
+
+  bits = 0;
+  for (i = 0; i < 256; i++) bits += (unsigned long long)ctx->hist[i] * ctx->table[i].nbits;
+
+  return 4 + ((ctx->codetree[0] + 1) << 1) + (unsigned int)(((bits + 31) >> 5) << 2);
+}
+
+/*----------------------------------------------------------------------------*/
+int HUF_Code(HUFCTX *ctx, const unsigned char *raw_buffer, int raw_len, unsigned char *pak_buffer, int pak_max) {
+  unsigned char *pak, *pak_end, *cod;
+  const unsigned char *raw, *raw_end;
+  unsigned int   pak_len, len;
+  huffman_code  *code;
+  unsigned long long bits;
+  unsigned int   nbits;
+
+  if (pak_max < 4) return CPRS_ERR_SPACE;
+  if ((ctx->limit != NULL) && (HUF_CodeSize(ctx) > __atomic_load_n(ctx->limit, __ATOMIC_RELAXED))) return CPRS_ERR_SPACE;
+
+  write32le(pak_buffer, (CMD_CODE_20 + ctx->num_bits) | (raw_len << 8));
+
+  pak = pak_buffer + 4;
+  pak_end = pak_buffer + pak_max;
+  raw = raw_buffer;
+  raw_end = raw_buffer + raw_len;
+
+  cod = ctx->codetree;
+  len = (*cod + 1) << 1;
+  if (pak + len > pak_end) return CPRS_ERR_SPACE;
+  while (len--) *pak++ = *cod++;
+
+  // The bits go into 32bit words from the top; bits holds the last
+  // nbits of them that haven't gone out yet.
+  bits = 0;
+  nbits = 0;
+  while (raw < raw_end) {
+    code = &ctx->table[*raw++];
+    len = code->nbits;
+    if (len > 32) {
+      bits = (bits << (len - 32)) | (code->code >> 32);
+      nbits += len - 32;
+      len = 32;
+      if (nbits >= 32) {
+        if (pak + 4 > pak_end) return CPRS_ERR_SPACE;
+        nbits -= 32;
+        write32le(pak, (unsigned int)(bits >> nbits));
+        pak += 4;
+      }
+    }
+    bits = (bits << len) | (code->code & 0xFFFFFFFF);
+    nbits += len;
+    if (nbits >= 32) {
+      if (pak + 4 > pak_end) return CPRS_ERR_SPACE;
+      nbits -= 32;
+      write32le(pak, (unsigned int)(bits >> nbits));
+      pak += 4;
+    }
+  }
+  if (nbits) {
+    if (pak + 4 > pak_end) return CPRS_ERR_SPACE;
+    write32le(pak, (unsigned int)(bits << (32 - nbits)));
+    pak += 4;
+  }
+
+  pak_len = pak - pak_buffer;
+
+  return pak_len;
+}
+
+/*----------------------------------------------------------------------------*/
+/* Count bytes, on threads for big inputs.                                   */
+void HUF_CreateHistogram(HUFCTX *ctx, const unsigned char *raw_buffer, int raw_len) {
+  huffman_count  part[HUF_FREQ_THR];
+  pthread_t      tid[HUF_FREQ_THR];
+  unsigned int  *hist, len;
+  unsigned int   i, j, n, started;
+  long           cpus;
+
+  hist = ctx->hist;
+
+  n = 1;
+  if (raw_len >= HUF_FREQ_MT) {
+    cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    n = cpus < 1 ? 1 : MIN(cpus, MIN(HUF_FREQ_THR, raw_len / (HUF_FREQ_MT >> 2)));
+  }
+  len = (raw_len + n - 1) / n;
+  for (i = 0; i < n; i++) {
+    part[i].raw = raw_buffer + i*len;
+    part[i].len = MIN(len, raw_len - i*len);
+  }
+  for (started = 1; started < n; started++)
+    if (pthread_create(&tid[started], NULL, HUF_CountThread, &part[started])) break;
+  HUF_Histogram(part[0].raw, part[0].len, hist);
+  for (i = 1; i < n; i++) {
+    if (i < started) pthread_join(tid[i], NULL);
+    else HUF_Histogram(part[i].raw, part[i].len, part[i].hist);
+    for (j = 0; j < 256; j++) hist[j] += part[i].hist[j];
+  }
+}
+
+/*----------------------------------------------------------------------------*/
+/* The symbols in the bytes counted.                                         */
+void HUF_CreateFreqs(HUFCTX *ctx) {
+  unsigned int *freqs, *hist, ch, nbits;
+  unsigned int  i;
+
+  freqs = ctx->freqs;
+  hist = ctx->hist;
+  memset(freqs, 0, ctx->max_symbols * sizeof(unsigned int));
+
+  for (i = 0; i < 256; i++) {
+    if (!hist[i]) continue;
+    ch = i;
+    for (nbits = 8; nbits; nbits -= ctx->num_bits) {
+      freqs[ch >> (8 - ctx->num_bits)] += hist[i];
+      ch = (ch << ctx->num_bits) & 0xFF;
+    }
+  }
+
+  ctx->num_leafs = 0;
+  for (i = 0; i < ctx->max_symbols; i++) if (freqs[i]) ctx->num_leafs++;
+
+
+  if (ctx->num_leafs < 2) {
+    if (ctx->num_leafs == 1) {
+      for (i = 0; i < ctx->max_symbols; i++) {
+        if (freqs[i]) {
+          freqs[i] = 1;
+          break;
+        }
+      }
+    }
+
+    while (ctx->num_leafs < 2) {
+      for (i = 0; i < ctx->max_symbols; i++) {
+        if (!freqs[i]) {
+          freqs[i] = 2;
+          break;
+        }
+      }
+      ctx->num_leafs++;
+    }
+  }
+
+  ctx->num_nodes = (ctx->num_leafs << 1) - 1;
+}
+
+/*----------------------------------------------------------------------------*/
+/* Byte histogram, in four interleaved ones so runs of the same byte don't   */
+/* wait on their own counter.                                                */
+void HUF_Histogram(const unsigned char *raw, unsigned int len, unsigned int *hist) {
+  unsigned int sub[4][256];
+  unsigned int i;
+
+  memset(sub, 0, sizeof(sub));
+
+  for (i = 0; i + 4 <= len; i += 4) {
+    sub[0][raw[i    ]]++;
+    sub[1][raw[i + 1]]++;
+    sub[2][raw[i + 2]]++;
+    sub[3][raw[i + 3]]++;
+  }
+  for ( ; i < len; i++) sub[0][raw[i]]++;
+
+  for (i = 0; i < 256; i++) hist[i] = sub[0][i] + sub[1][i] + sub[2][i] + sub[3][i];
+}
+
+/*----------------------------------------------------------------------------*/
+void *HUF_CountThread(void *arg) {
+  huffman_count *part = (huffman_count *) arg;
+
+  HUF_Histogram(part->raw, part->len, part->hist);
+  return NULL;
+}
+
+/*----------------------------------------------------------------------------*/
+void HUF_CreateTree(HUFCTX *ctx) {
+  huffman_node *node, *lnode, *rnode, **tree, **leafs;
+  unsigned int  num_leafs, num_nodes, num_node, l, n;
+  unsigned int  i;
+
+  tree = ctx->tree;
+  leafs = ctx->leafs;
+  num_leafs = ctx->num_leafs;
+  num_nodes = ctx->num_nodes;
+
+  num_node = 0;
+  for (i = 0; i < ctx->max_symbols; i++) {
+    if (ctx->freqs[i]) {
+      node = &ctx->nodes[num_node];
+      tree[num_node++] = node;
+
+      node->symbol = i;
+      node->weight = ctx->freqs[i];
+      node->leafs  = 1;
+      node->dad    = NULL;
+      node->lson   = NULL;
+      node->rson   = NULL;
+    }
+  }
+
+  // Two queues: the leafs by weight, and the new nodes, which come out
+  // by weight on their own. Ties go to the lower index in tree[], so
+  // leafs before nodes and then in symbol order.
+  for (i = 0; i < num_leafs; i++) leafs[i] = tree[i];
+  qsort(leafs, num_leafs, sizeof(huffman_node *), HUF_CompareLeafs);
+
+  l = 0;
+  n = num_leafs;
+  while (num_node < num_nodes) {
+    if ((l < num_leafs) && ((n == num_node) || (leafs[l]->weight <= tree[n]->weight)))
+      lnode = leafs[l++];
+    else
+      lnode = tree[n++];
+    if ((l < num_leafs) && ((n == num_node) || (leafs[l]->weight <= tree[n]->weight)))
+      rnode = leafs[l++];
+    else
+      rnode = tree[n++];
+
+    node = &ctx->nodes[num_node];
+    tree[num_node++] = node;
+
+    node->symbol = num_node - num_leafs + ctx->max_symbols;
+    node->weight = lnode->weight + rnode->weight;
+    node->leafs  = lnode->leafs + rnode->leafs;
+    node->dad    = NULL;
+    node->lson   = lnode;
+    node->rson   = rnode;
+
+    lnode->dad = rnode->dad = node;
+  }
+}
+
+/*----------------------------------------------------------------------------*/
+int HUF_CompareLeafs(const void *a, const void *b) {
+  const huffman_node *na = *(huffman_node * const *)a;
+  const huffman_node *nb = *(huffman_node * const *)b;
+
+  if (na->weight != nb->weight) return na->weight < nb->weight ? -1 : 1;
+  return na->symbol < nb->symbol ? -1 : (na->symbol > nb->symbol);
+}
+
+/*----------------------------------------------------------------------------*/
+/* Lay the tree out in one pass. Node pairs go into the table one after the  */
+/* other, and a node's children have to come at most HUF_NEXT+1 pairs after  */
+/* its own. The nodes still waiting for their children are expanded depth    */
+/* first, which keeps their number down, unless the oldest ones are running  */
+/* out of room: the k-th oldest has to be expanded within k pairs of its     */
+/* last chance. No more than HUF_NEXT+1 nodes can be waiting at any time, so */
+/* the checks keep this linear. Returns 0 if a node misses its deadline      */
+/* anyway, which very lopsided trees of many leafs can make it do.           */
+int HUF_CreateCodeTree(HUFCTX *ctx) {
+  huffman_node **wait, *node, *son;
+  unsigned char *codetree;
+  unsigned int  *at, head, tail, pair, ofs, i;
+
+  codetree = ctx->codetree;
+  wait = ctx->wait;
+  at = ctx->at;
+
+  memset(codetree, 0, (((ctx->num_leafs - 1) | 1) + 1) << 1);
+  codetree[0] = (ctx->num_leafs - 1) | 1;
+
+  node = ctx->tree[ctx->num_nodes - 1];
+  codetree[1] = HUF_CodeFlags(node);
+  head = tail = 0;
+  wait[tail] = node;
+  at[tail++] = 1;
+
+  for (pair = 1; head < tail; pair++) {
+    for (i = head; i < tail; i++)
+      if ((at[i] >> 1) + HUF_NEXT + 1 <= pair + (i - head)) break;
+
+    if (i < tail) { node = wait[head]; ofs = at[head++]; }
+    else          { node = wait[--tail]; ofs = at[tail]; }
+
+    if (pair - (ofs >> 1) - 1 > HUF_NEXT) return 0;
+    codetree[ofs] |= pair - (ofs >> 1) - 1;
+
+    for (i = 0; i < 2; i++) {
+      son = i ? node->rson : node->lson;
+      if (son->leafs == 1) {
+        codetree[(pair << 1) + i] = son->symbol;
+      } else {
+        codetree[(pair << 1) + i] = HUF_CodeFlags(son);
+        wait[tail] = son;
+        at[tail++] = (pair << 1) + i;
+      }
+    }
+  }
+
+  return 1;
+}
+
+/*----------------------------------------------------------------------------*/
+unsigned char HUF_CodeFlags(const huffman_node *node) {
+  return (node->lson->leafs == 1 ? HUF_LCHAR : 0) | (node->rson->leafs == 1 ? HUF_RCHAR : 0);
+}
+
+/*----------------------------------------------------------------------------*/
+void HUF_CreateCodeWorks(HUFCTX *ctx) {
+  huffman_node  *node;
+  huffman_code  *code;
+  unsigned int   i;
+
+  memset(ctx->codes, 0, ctx->max_symbols * sizeof(huffman_code));
+
+  for (i = 0; i < ctx->num_leafs; i++) {
+    node = ctx->tree[i];
+    code = &ctx->codes[node->symbol];
+
+    // Walking up gives the bits last one first.
+    code->nbits = 0;
+    code->code  = 0;
+    while (node->dad != NULL) {
+      if (node->dad->lson != node) code->code |= 1ULL << code->nbits;
+      code->nbits++;
+      node = node->dad;
+    }
+  }
+}
+
+/*----------------------------------------------------------------------------*/
+/*--  EOF                                           Copyright (C) 2011 CUE  --*/
+/*----------------------------------------------------------------------------*/